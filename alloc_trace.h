@@ -0,0 +1,223 @@
+#ifndef ALLOC_TRACE_H
+#define ALLOC_TRACE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#define TRACE_MAGIC "SMTRACE1"
+#define TRACE_BUFFER_RECORDS 4096 // Records buffered per thread before one write()
+#define TRACE_NOW UINT64_MAX      // _record_at: stamp the record when it is written
+
+enum TraceOp : uint8_t {
+    TRACE_SMALLOC = 1,
+    TRACE_SCALLOC = 2,
+    TRACE_SREALLOC = 3,
+    TRACE_SFREE = 4,
+};
+
+// File layout: one TraceHeader followed by TraceRecords. Each thread appends
+// whole buffers, so records are grouped per thread and only ordered by
+// m_timestamp across threads; readers sort before replaying.
+struct TraceHeader {
+    char m_magic[8];
+    uint32_t m_record_size;
+    uint32_t m_reserved;
+};
+
+struct TraceRecord {
+    uint64_t m_timestamp; // ns since the trace was started
+    uint64_t m_addr;      // Returned pointer (0 on failure), or the pointer freed
+    uint64_t m_aux;       // srealloc: the old pointer, scalloc: element count
+    uint32_t m_size;      // Requested size (scalloc: element size); sizes are capped by MAX_MEM
+    uint16_t m_thread;
+    uint8_t m_op;
+    uint8_t m_reserved;
+};
+
+// One thread's buffer. Buffers are never freed: a thread that exits flushes
+// and releases its buffer so a later thread can claim it.
+struct TraceBuffer {
+    std::atomic<bool> m_in_use;
+    std::atomic<bool> m_busy; // Owner is appending; trace stop waits on it
+    TraceBuffer* m_next;
+    uint16_t m_thread;
+    size_t m_count;
+    TraceRecord m_records[TRACE_BUFFER_RECORDS];
+};
+
+// Records every allocator call into per-thread buffers. The owning thread
+// appends without locks; full buffers go to the trace file with a single
+// write() on an O_APPEND descriptor, which keeps each buffer contiguous.
+class AllocTracer {
+private:
+    std::atomic<bool> _enabled_flag;
+    std::atomic<TraceBuffer*> _buffers;
+    std::atomic<uint16_t> _next_thread;
+    int _fd;
+    uint64_t _start_ns;
+
+    static uint64_t _now_ns();
+    TraceBuffer* _claim_buffer();
+    void _flush(TraceBuffer* buf);
+
+public:
+    AllocTracer() : _enabled_flag(false), _buffers(nullptr), _next_thread(0), _fd(-1), _start_ns(0) {}
+
+    // The only check on the allocation fast path
+    bool _enabled() const {
+        return _enabled_flag.load(std::memory_order_relaxed);
+    }
+
+    // Time since the trace was started, for a record written later
+    uint64_t _timestamp() const {
+        return _now_ns() - _start_ns;
+    }
+
+    bool _start(const char* path);
+    void _stop();
+    void _record(TraceBuffer*& buf, TraceOp op, void* addr, size_t size, uint64_t aux);
+    // A record stamped with an earlier _timestamp(), or TRACE_NOW. Calls that
+    // both take and release blocks stamp between the two, so replay order
+    // matches the order addresses changed hands.
+    void _record_at(TraceBuffer*& buf, uint64_t timestamp, TraceOp op, void* addr, size_t size,
+                    uint64_t aux);
+    void _release(TraceBuffer* buf);
+};
+
+inline uint64_t AllocTracer::_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+inline TraceBuffer* AllocTracer::_claim_buffer() {
+    // Reuse a buffer left behind by an exited thread before mapping a new one
+    for (TraceBuffer* b = _buffers.load(std::memory_order_acquire); b; b = b->m_next) {
+        bool expected = false;
+        if (!b->m_in_use.load(std::memory_order_relaxed) &&
+            b->m_in_use.compare_exchange_strong(expected, true)) {
+            b->m_thread = _next_thread.fetch_add(1);
+            return b;
+        }
+    }
+
+    void* mem = mmap(nullptr, sizeof(TraceBuffer), PROT_READ | PROT_WRITE,
+                     MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) {
+        return nullptr;
+    }
+    TraceBuffer* b = static_cast<TraceBuffer*>(mem); // mmap memory is zeroed
+    b->m_in_use.store(true, std::memory_order_relaxed);
+    b->m_thread = _next_thread.fetch_add(1);
+    TraceBuffer* head = _buffers.load(std::memory_order_relaxed);
+    do {
+        b->m_next = head;
+    } while (!_buffers.compare_exchange_weak(head, b, std::memory_order_release,
+                                             std::memory_order_relaxed));
+    return b;
+}
+
+inline void AllocTracer::_flush(TraceBuffer* buf) {
+    if (buf->m_count == 0) {
+        return;
+    }
+    size_t bytes = buf->m_count * sizeof(TraceRecord);
+    if (_fd >= 0 && write(_fd, buf->m_records, bytes) != (ssize_t)bytes) {
+        // A short write would leave a torn record behind; stop tracing instead
+        _enabled_flag.store(false, std::memory_order_relaxed);
+    }
+    buf->m_count = 0;
+}
+
+inline bool AllocTracer::_start(const char* path) {
+    if (_enabled()) {
+        return false;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    TraceHeader header;
+    memcpy(header.m_magic, TRACE_MAGIC, sizeof(header.m_magic));
+    header.m_record_size = sizeof(TraceRecord);
+    header.m_reserved = 0;
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+        close(fd);
+        return false;
+    }
+    _fd = fd;
+    _start_ns = _now_ns();
+    _enabled_flag.store(true, std::memory_order_seq_cst);
+    return true;
+}
+
+inline void AllocTracer::_stop() {
+    if (!_enabled()) {
+        return;
+    }
+    _enabled_flag.store(false, std::memory_order_seq_cst);
+    // Pairs with the seq_cst m_busy store in _record(): a thread either sees
+    // tracing disabled or is seen busy here, and then we wait for it
+    for (TraceBuffer* b = _buffers.load(std::memory_order_acquire); b; b = b->m_next) {
+        while (b->m_busy.load(std::memory_order_seq_cst)) {
+            sched_yield();
+        }
+        _flush(b);
+    }
+    close(_fd);
+    _fd = -1;
+}
+
+inline void AllocTracer::_record(TraceBuffer*& buf, TraceOp op, void* addr, size_t size, uint64_t aux) {
+    _record_at(buf, TRACE_NOW, op, addr, size, aux);
+}
+
+inline void AllocTracer::_record_at(TraceBuffer*& buf, uint64_t timestamp, TraceOp op, void* addr,
+                                    size_t size, uint64_t aux) {
+    if (timestamp == TRACE_NOW) {
+        timestamp = _timestamp();
+    }
+    if (!buf) {
+        buf = _claim_buffer();
+        if (!buf) {
+            return;
+        }
+    }
+    buf->m_busy.store(true, std::memory_order_seq_cst);
+    if (_enabled_flag.load(std::memory_order_seq_cst)) {
+        TraceRecord& r = buf->m_records[buf->m_count++];
+        r.m_timestamp = timestamp;
+        r.m_addr = reinterpret_cast<uint64_t>(addr);
+        r.m_aux = aux;
+        r.m_size = (uint32_t)size;
+        r.m_thread = buf->m_thread;
+        r.m_op = op;
+        r.m_reserved = 0;
+        if (buf->m_count == TRACE_BUFFER_RECORDS) {
+            _flush(buf);
+        }
+    }
+    buf->m_busy.store(false, std::memory_order_release);
+}
+
+// Called when a thread exits: its pending records go out and the buffer is
+// returned to the pool
+inline void AllocTracer::_release(TraceBuffer* buf) {
+    if (!buf) {
+        return;
+    }
+    buf->m_busy.store(true, std::memory_order_seq_cst);
+    if (_enabled_flag.load(std::memory_order_seq_cst)) {
+        _flush(buf);
+    }
+    buf->m_busy.store(false, std::memory_order_release);
+    buf->m_in_use.store(false, std::memory_order_release);
+}
+
+#endif // ALLOC_TRACE_H
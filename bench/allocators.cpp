@@ -0,0 +1,86 @@
+// The allocators compared by smalloc_bench. Each variant library puts its API
+// in its own namespace, so all of them can sit side by side in one binary.
+#include "bench.h"
+#include "../smalloc.h"
+#include <stdlib.h>
+#include <string.h>
+
+SMALLOC_DECLARE_API(malloc_1)
+SMALLOC_DECLARE_API(malloc_2)
+SMALLOC_DECLARE_API(malloc_3)
+SMALLOC_DECLARE_API(malloc_4)
+SMALLOC_DECLARE_API(malloc_3_small)
+SMALLOC_DECLARE_API(malloc_3_large)
+SMALLOC_DECLARE_API(malloc_3_lazy)
+namespace malloc_3 {
+void sfree_sized(void* p, size_t size);
+}
+
+// malloc_1 only has smalloc: nothing is ever freed, and scalloc/srealloc are
+// emulated on top of smalloc
+static void* malloc_1_calloc(size_t num, size_t size) {
+    void* p = malloc_1::smalloc(num * size);
+    if (p) {
+        memset(p, 0, num * size);
+    }
+    return p;
+}
+
+static void malloc_1_free(void*) {
+}
+
+static void* malloc_1_realloc(void* p, size_t old_size, size_t new_size) {
+    void* q = malloc_1::smalloc(new_size);
+    if (q && p) {
+        memcpy(q, p, old_size < new_size ? old_size : new_size);
+    }
+    return q;
+}
+
+static void* malloc_2_realloc(void* p, size_t, size_t new_size) {
+    return malloc_2::srealloc(p, new_size);
+}
+
+static void* malloc_3_realloc(void* p, size_t, size_t new_size) {
+    return malloc_3::srealloc(p, new_size);
+}
+
+// malloc_3 built with a 64-byte minimum block and with a 1 MB maximum block
+static void* malloc_3_small_realloc(void* p, size_t, size_t new_size) {
+    return malloc_3_small::srealloc(p, new_size);
+}
+
+static void* malloc_3_large_realloc(void* p, size_t, size_t new_size) {
+    return malloc_3_large::srealloc(p, new_size);
+}
+
+// and with lazy coalescing
+static void* malloc_3_lazy_realloc(void* p, size_t, size_t new_size) {
+    return malloc_3_lazy::srealloc(p, new_size);
+}
+
+static void* malloc_4_realloc(void* p, size_t, size_t new_size) {
+    return malloc_4::srealloc(p, new_size);
+}
+
+static void* glibc_realloc(void* p, size_t, size_t new_size) {
+    return realloc(p, new_size);
+}
+
+const std::vector<BenchAllocator>& bench_allocators() {
+    static const std::vector<BenchAllocator> allocators = {
+            {"glibc", true, true, 1.0, malloc, calloc, free, glibc_realloc, nullptr},
+            {"malloc_1", false, false, 1.0, malloc_1::smalloc, malloc_1_calloc, malloc_1_free, malloc_1_realloc, nullptr},
+            {"malloc_2", true, false, 0.05, malloc_2::smalloc, malloc_2::scalloc, malloc_2::sfree, malloc_2_realloc, nullptr},
+            {"malloc_3", true, true, 1.0, malloc_3::smalloc, malloc_3::scalloc, malloc_3::sfree, malloc_3_realloc,
+             malloc_3::sfree_sized},
+            {"malloc_3_small", true, true, 1.0, malloc_3_small::smalloc, malloc_3_small::scalloc, malloc_3_small::sfree,
+             malloc_3_small_realloc, nullptr},
+            {"malloc_3_large", true, true, 1.0, malloc_3_large::smalloc, malloc_3_large::scalloc, malloc_3_large::sfree,
+             malloc_3_large_realloc, nullptr},
+            {"malloc_3_lazy", true, true, 1.0, malloc_3_lazy::smalloc, malloc_3_lazy::scalloc, malloc_3_lazy::sfree,
+             malloc_3_lazy_realloc, nullptr},
+            {"malloc_4", true, true, 1.0, malloc_4::smalloc, malloc_4::scalloc, malloc_4::sfree, malloc_4_realloc, nullptr},
+    };
+    return allocators;
+}
@@ -0,0 +1,76 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// One allocator under test. All of them are linked into the same binary:
+// the variants through their namespaced libraries (see smalloc.h), glibc
+// directly. allocators.cpp holds the table.
+struct BenchAllocator {
+    const char* m_name;
+    bool m_can_free;     // malloc_1 only grows the program break
+    bool m_thread_safe;  // malloc_1 and malloc_2 have no locking
+    double m_scale;      // Multiplies --scale; malloc_2 scans a list on every call
+    void* (*m_malloc)(size_t size);
+    void* (*m_calloc)(size_t num, size_t size);
+    void (*m_free)(void* p);
+    // The old size lets allocators without a realloc copy the right amount
+    void* (*m_realloc)(void* p, size_t old_size, size_t new_size);
+    void (*m_free_sized)(void* p, size_t size); // nullptr without a sized free
+};
+
+const std::vector<BenchAllocator>& bench_allocators();
+
+// Filled in by a benchmark running in a forked child and sent to the parent
+struct BenchResult {
+    uint64_t m_ops;
+    double m_seconds;
+    double m_p50_ns;
+    double m_p99_ns;
+    double m_p999_ns;
+    uint64_t m_failed; // Allocations that returned nullptr
+};
+
+// Collects sampled per-operation latencies (every BENCH_SAMPLE_EVERY-th op)
+#define BENCH_SAMPLE_EVERY 8
+
+class LatencySamples {
+private:
+    std::vector<uint64_t> _cycles;
+
+public:
+    void _reserve(size_t ops) { _cycles.reserve(ops / BENCH_SAMPLE_EVERY + 1); }
+    void _add(uint64_t cycles) { _cycles.push_back(cycles); }
+    void _append(const LatencySamples& other) {
+        _cycles.insert(_cycles.end(), other._cycles.begin(), other._cycles.end());
+    }
+    // Fills the percentile fields of `result`
+    void _finish(BenchResult& result);
+};
+
+uint64_t bench_cycles();
+double bench_seconds();
+
+// Touches one byte per page so untouched memory is not free for mmap-backed blocks
+void bench_touch(void* p, size_t size);
+
+// Streams through a buffer larger than the last-level cache
+void bench_evict_caches();
+
+struct BenchCase;
+typedef void (*BenchFn)(const BenchAllocator& alloc, const BenchCase& bench, double scale, BenchResult& result);
+
+struct BenchCase {
+    const char* m_name;
+    BenchFn m_fn;
+    size_t m_param;      // Benchmark specific, e.g. the object size
+    int m_threads;       // > 1 needs a thread-safe allocator
+    bool m_needs_free;
+    bool m_needs_sized_free;
+};
+
+const std::vector<BenchCase>& bench_cases();
+
+#endif // BENCH_H
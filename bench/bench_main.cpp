@@ -0,0 +1,111 @@
+// Runs every benchmark against every allocator in bench_allocators() and
+// prints one CSV row per pair:
+//   smalloc_bench [--allocator name] [--scale X] [--filter substring] [--no-header]
+// Each benchmark runs in its own forked child, so it starts from a fresh
+// heap, its peak RSS can be read from wait4(), and a crashing allocator
+// only loses that one row.
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static void print_row(const BenchAllocator& alloc, const BenchCase& bench, const BenchResult& r, long peak_rss_kb, const char* status) {
+    double ops_per_sec = r.m_seconds > 0 ? r.m_ops / r.m_seconds : 0;
+    printf("%s,%s,%d,%llu,%.6f,%.0f,%.1f,%.1f,%.1f,%ld,%llu,%s\n",
+           alloc.m_name, bench.m_name, bench.m_threads,
+           (unsigned long long)r.m_ops, r.m_seconds, ops_per_sec,
+           r.m_p50_ns, r.m_p99_ns, r.m_p999_ns, peak_rss_kb,
+           (unsigned long long)r.m_failed, status);
+    fflush(stdout);
+}
+
+static void run_case(const BenchAllocator& alloc, const BenchCase& bench, double scale) {
+    BenchResult result;
+    memset(&result, 0, sizeof(result));
+
+    if (bench.m_threads > 1 && !alloc.m_thread_safe) {
+        print_row(alloc, bench, result, 0, "skipped_not_thread_safe");
+        return;
+    }
+    if (bench.m_needs_free && !alloc.m_can_free) {
+        print_row(alloc, bench, result, 0, "skipped_no_free");
+        return;
+    }
+    if (bench.m_needs_sized_free && !alloc.m_free_sized) {
+        print_row(alloc, bench, result, 0, "skipped_no_sized_free");
+        return;
+    }
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        bench.m_fn(alloc, bench, scale * alloc.m_scale, result);
+        ssize_t written = write(fds[1], &result, sizeof(result));
+        _exit(written == (ssize_t)sizeof(result) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    bool complete = read(fds[0], &result, sizeof(result)) == (ssize_t)sizeof(result);
+    close(fds[0]);
+    int status = 0;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    wait4(pid, &status, 0, &usage);
+
+    bool ok = complete && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (!ok) {
+        memset(&result, 0, sizeof(result));
+    }
+    print_row(alloc, bench, result, usage.ru_maxrss, ok ? "ok" : "crashed");
+}
+
+int main(int argc, char** argv) {
+    double scale = 1.0;
+    const char* filter = nullptr;
+    const char* allocator = nullptr;
+    bool header = true;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--allocator") == 0 && i + 1 < argc) {
+            allocator = argv[++i];
+        } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--no-header") == 0) {
+            header = false;
+        } else {
+            fprintf(stderr, "usage: %s [--allocator name] [--scale X] [--filter substring] [--no-header]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (header) {
+        printf("allocator,benchmark,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,peak_rss_kb,failed,status\n");
+    }
+    for (const BenchAllocator& alloc : bench_allocators()) {
+        if (allocator && strcmp(alloc.m_name, allocator) != 0) {
+            continue;
+        }
+        for (const BenchCase& bench : bench_cases()) {
+            if (filter && !strstr(bench.m_name, filter)) {
+                continue;
+            }
+            run_case(alloc, bench, scale);
+        }
+    }
+    return 0;
+}
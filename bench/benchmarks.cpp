@@ -0,0 +1,544 @@
+#include "bench.h"
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <algorithm>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define PAGE_SIZE_BYTES 4096
+#define EVICT_BYTES (64 * 1024 * 1024)
+
+uint64_t bench_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+double bench_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Cycles per nanosecond, measured once against the monotonic clock
+static double cycles_per_ns() {
+    static double ratio = 0;
+    if (ratio == 0) {
+        double t0 = bench_seconds();
+        uint64_t c0 = bench_cycles();
+        while (bench_seconds() - t0 < 0.02) {
+        }
+        ratio = (bench_cycles() - c0) / ((bench_seconds() - t0) * 1e9);
+    }
+    return ratio;
+}
+
+void LatencySamples::_finish(BenchResult& result) {
+    if (_cycles.empty()) {
+        return;
+    }
+    std::sort(_cycles.begin(), _cycles.end());
+    double ratio = cycles_per_ns();
+    size_t n = _cycles.size();
+    result.m_p50_ns = _cycles[n / 2] / ratio;
+    result.m_p99_ns = _cycles[std::min(n - 1, n * 99 / 100)] / ratio;
+    result.m_p999_ns = _cycles[std::min(n - 1, n * 999 / 1000)] / ratio;
+}
+
+void bench_touch(void* p, size_t size) {
+    char* c = static_cast<char*>(p);
+    for (size_t off = 0; off < size; off += PAGE_SIZE_BYTES) {
+        c[off] = 1;
+    }
+    c[size - 1] = 1;
+}
+
+void bench_evict_caches() {
+    static char* buffer = nullptr;
+    if (!buffer) {
+        void* mem = mmap(nullptr, EVICT_BYTES, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+        if (mem == MAP_FAILED) {
+            return;
+        }
+        buffer = static_cast<char*>(mem);
+    }
+    for (size_t off = 0; off < EVICT_BYTES; off += 64) {
+        buffer[off]++;
+    }
+}
+
+// xorshift64*, deterministic so every allocator sees the same request stream
+class BenchRng {
+private:
+    uint64_t _state;
+
+public:
+    explicit BenchRng(uint64_t seed) : _state(seed * 0x9E3779B97F4A7C15ull + 1) {}
+    uint64_t _next() {
+        _state ^= _state >> 12;
+        _state ^= _state << 25;
+        _state ^= _state >> 27;
+        return _state * 0x2545F4914F6CDD1Dull;
+    }
+    // Log-uniform in [lo, hi]: small sizes dominate, as in real programs
+    size_t _size(size_t lo, size_t hi) {
+        int lo_bits = 63 - __builtin_clzll(lo);
+        int hi_bits = 63 - __builtin_clzll(hi);
+        int bits = lo_bits + (int)(_next() % (hi_bits - lo_bits + 1));
+        size_t base = (size_t)1 << bits;
+        size_t size = base + _next() % base;
+        return std::max(lo, std::min(hi, size));
+    }
+};
+
+// Times one call every BENCH_SAMPLE_EVERY ops, counting from `op`
+#define TIMED(op, samples, expr)                          \
+    do {                                                  \
+        if ((op) % BENCH_SAMPLE_EVERY == 0) {             \
+            uint64_t _t0 = bench_cycles();                \
+            expr;                                         \
+            (samples)._add(bench_cycles() - _t0);         \
+        } else {                                          \
+            expr;                                         \
+        }                                                 \
+    } while (0)
+
+// Allocates a batch of equally sized objects, then frees them, repeatedly.
+// The batch is capped at 1 MB so it fits the buddy allocators' base 4 MB pool.
+static void bench_size_class(const BenchAllocator& alloc, const BenchCase& bench,
+                             double scale, BenchResult& result) {
+    size_t size = bench.m_param;
+    size_t batch = std::max<size_t>(16, std::min<size_t>(1000, (1 << 20) / size));
+    size_t rounds = alloc.m_can_free ? std::max<size_t>(1, (size_t)(2000000 * scale / batch)) : 1;
+    std::vector<void*> ptrs(batch);
+    LatencySamples samples;
+    samples._reserve(rounds * batch * 2);
+
+    uint64_t op = 0;
+    double start = bench_seconds();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < batch; i++, op++) {
+            TIMED(op, samples, ptrs[i] = alloc.m_malloc(size));
+            if (!ptrs[i]) {
+                result.m_failed++;
+            } else {
+                *(char*)ptrs[i] = 1;
+            }
+        }
+        if (!alloc.m_can_free) {
+            continue;
+        }
+        for (size_t i = 0; i < batch; i++, op++) {
+            TIMED(op, samples, alloc.m_free(ptrs[i]));
+        }
+    }
+    result.m_seconds = bench_seconds() - start;
+    result.m_ops = op;
+    samples._finish(result);
+}
+
+// Random sizes over a fixed set of live slots: every op frees the slot's
+// previous object and allocates a new one
+static void bench_churn(const BenchAllocator& alloc, const BenchCase& bench,
+                        double scale, BenchResult& result) {
+    const size_t slots = 512;
+    size_t ops = (size_t)(2000000 * scale);
+    std::vector<void*> live(slots, nullptr);
+    BenchRng rng(1);
+    LatencySamples samples;
+    samples._reserve(ops * 2);
+
+    uint64_t op = 0;
+    double start = bench_seconds();
+    for (size_t i = 0; i < ops; i++) {
+        size_t slot = rng._next() % slots;
+        size_t size = rng._size(16, bench.m_param);
+        if (live[slot]) {
+            TIMED(op, samples, alloc.m_free(live[slot]));
+            op++;
+        }
+        TIMED(op, samples, live[slot] = alloc.m_malloc(size));
+        op++;
+        if (!live[slot]) {
+            result.m_failed++;
+        } else {
+            *(char*)live[slot] = 1;
+        }
+    }
+    for (void* p : live) {
+        alloc.m_free(p);
+    }
+    result.m_seconds = bench_seconds() - start;
+    result.m_ops = op;
+    samples._finish(result);
+}
+
+// One object of m_param bytes allocated and freed over and over. A buddy
+// allocator that coalesces on every free splits a max-order block all the
+// way down again on every allocation.
+static void bench_ping_pong(const BenchAllocator& alloc, const BenchCase& bench,
+                            double scale, BenchResult& result) {
+    size_t ops = std::max<size_t>(1, (size_t)(2000000 * scale));
+    LatencySamples samples;
+    samples._reserve(ops);
+
+    uint64_t op = 0;
+    double start = bench_seconds();
+    for (size_t i = 0; i < ops; i++) {
+        void* p;
+        TIMED(op, samples, p = alloc.m_malloc(bench.m_param));
+        op++;
+        if (!p) {
+            result.m_failed++;
+            continue;
+        }
+        *(char*)p = 1;
+        TIMED(op, samples, alloc.m_free(p));
+        op++;
+    }
+    result.m_seconds = bench_seconds() - start;
+    result.m_ops = op;
+    samples._finish(result);
+}
+
+// Short-lived large blocks: a few live slots, each op replacing one with a
+// block of m_param/3 to m_param bytes. Every block is above the buddy pools'
+// 128 KB limit, so this measures what a large allocation costs after the
+// first ones were freed.
+static void bench_large_churn(const BenchAllocator& alloc, const BenchCase& bench,
+                              double scale, BenchResult& result) {
+    const size_t slots = 8;
+    size_t ops = std::max<size_t>(1, (size_t)(200000 * scale));
+    size_t lo = bench.m_param / 3;
+    std::vector<void*> live(slots, nullptr);
+    BenchRng rng(2);
+    LatencySamples samples;
+    samples._reserve(ops * 2);
+
+    uint64_t op = 0;
+    double start = bench_seconds();
+    for (size_t i = 0; i < ops; i++) {
+        size_t slot = rng._next() % slots;
+        size_t size = lo + rng._next() % (bench.m_param - lo + 1);
+        if (live[slot]) {
+            TIMED(op, samples, alloc.m_free(live[slot]));
+            op++;
+        }
+        TIMED(op, samples, live[slot] = alloc.m_malloc(size));
+        op++;
+        if (!live[slot]) {
+            result.m_failed++;
+        } else {
+            *(char*)live[slot] = 1;
+        }
+    }
+    for (void* p : live) {
+        alloc.m_free(p);
+    }
+    result.m_seconds = bench_seconds() - start;
+    result.m_ops = op;
+    samples._finish(result);
+}
+
+// Grows buffers from 16 bytes to m_param bytes by 1.5x steps, like a string
+// builder, writing the new tail each time
+static void bench_realloc_growth(const BenchAllocator& alloc, const BenchCase& bench,
+                                 double scale, BenchResult& result) {
+    size_t buffers = std::max<size_t>(1, (size_t)(20000 * scale));
+    LatencySamples samples;
+    samples._reserve(buffers * 32);
+
+    uint64_t op = 0;
+    double start = bench_seconds();
+    for (size_t b = 0; b < buffers; b++) {
+        size_t size = 16;
+        void* p;
+        TIMED(op, samples, p = alloc.m_malloc(size));
+        op++;
+        if (!p) {
+            result.m_failed++;
+            continue;
+        }
+        memset(p, 'x', size);
+        while (size < bench.m_param) {
+            size_t new_size = std::min(bench.m_param, size + size / 2);
+            void* q;
+            TIMED(op, samples, q = alloc.m_realloc(p, size, new_size));
+            op++;
+            if (!q) {
+                result.m_failed++;
+                break;
+            }
+            memset((char*)q + size, 'y', new_size - size);
+            p = q;
+            size = new_size;
+        }
+        alloc.m_free(p);
+        op++;
+    }
+    result.m_seconds = bench_seconds() - start;
+    result.m_ops = op;
+    samples._finish(result);
+}
+
+// Resizes live buffers to random sizes between 16 and m_param bytes, growing
+// and shrinking, with the neighbouring blocks in use. Growth in place only
+// works when the block's buddies happen to be free; otherwise the data is
+// copied to a new block.
+static void bench_realloc_random(const BenchAllocator& alloc, const BenchCase& bench,
+                                 double scale, BenchResult& result) {
+    const size_t slots = 128; // At most 2 MB of buddy blocks with m_param 8 KB
+    size_t ops = std::max<size_t>(1, (size_t)(500000 * scale));
+    std::vector<void*> live(slots, nullptr);
+    std::vector<size_t> sizes(slots, 0);
+    BenchRng rng(3);
+    LatencySamples samples;
+    samples._reserve(ops);
+
+    uint64_t op = 0;
+    double start = bench_seconds();
+    for (size_t i = 0; i < ops; i++, op++) {
+        size_t slot = rng._next() % slots;
+        size_t size = rng._size(16, bench.m_param);
+        void* q;
+        if (live[slot]) {
+            TIMED(op, samples, q = alloc.m_realloc(live[slot], sizes[slot], size));
+        } else {
+            TIMED(op, samples, q = alloc.m_malloc(size));
+        }
+        if (!q) {
+            result.m_failed++;
+            continue;
+        }
+        if (size > sizes[slot]) {
+            memset((char*)q + sizes[slot], 'z', size - sizes[slot]);
+        }
+        live[slot] = q;
+        sizes[slot] = size;
+    }
+    for (void* p : live) {
+        alloc.m_free(p);
+    }
+    result.m_seconds = bench_seconds() - start;
+    result.m_ops = op;
+    samples._finish(result);
+}
+
+// Allocates a large set of objects, evicts them from the caches, then frees
+// them in random order; only the frees are timed. With `sized` the frees go
+// through the allocator's sized free, which does not need the header's size.
+static void cold_free(const BenchAllocator& alloc, const BenchCase& bench,
+                      double scale, BenchResult& result, bool sized) {
+    const size_t objects = 16384; // 2 MB of 128-byte buddy blocks
+    size_t rounds = std::max<size_t>(1, (size_t)(8 * scale));
+    std::vector<void*> ptrs(objects);
+    BenchRng rng(1);
+    LatencySamples samples;
+    samples._reserve(rounds * objects);
+
+    uint64_t op = 0;
+    double seconds = 0;
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < objects; i++) {
+            ptrs[i] = alloc.m_malloc(bench.m_param);
+            if (!ptrs[i]) {
+                result.m_failed++;
+            }
+        }
+        for (size_t i = objects - 1; i > 0; i--) {
+            std::swap(ptrs[i], ptrs[rng._next() % (i + 1)]);
+        }
+        bench_evict_caches();
+
+        double start = bench_seconds();
+        if (sized) {
+            for (size_t i = 0; i < objects; i++, op++) {
+                TIMED(op, samples, alloc.m_free_sized(ptrs[i], bench.m_param));
+            }
+        } else {
+            for (size_t i = 0; i < objects; i++, op++) {
+                TIMED(op, samples, alloc.m_free(ptrs[i]));
+            }
+        }
+        seconds += bench_seconds() - start;
+    }
+    result.m_seconds = seconds;
+    result.m_ops = op;
+    samples._finish(result);
+}
+
+static void bench_cold_free(const BenchAllocator& alloc, const BenchCase& bench,
+                            double scale, BenchResult& result) {
+    cold_free(alloc, bench, scale, result, false);
+}
+
+static void bench_cold_free_sized(const BenchAllocator& alloc, const BenchCase& bench,
+                                  double scale, BenchResult& result) {
+    cold_free(alloc, bench, scale, result, true);
+}
+
+// Zeroed arrays from 256 KB to m_param bytes; every page is touched so the
+// cost of faulting memory in is part of the measurement
+static void bench_scalloc_large(const BenchAllocator& alloc, const BenchCase& bench,
+                                double scale, BenchResult& result) {
+    size_t reps = std::max<size_t>(1, (size_t)(20 * scale));
+    LatencySamples samples;
+
+    uint64_t op = 0;
+    double start = bench_seconds();
+    for (size_t r = 0; r < reps; r++) {
+        for (size_t size = 256 * 1024; size <= bench.m_param; size *= 4) {
+            void* p;
+            uint64_t t0 = bench_cycles();
+            p = alloc.m_calloc(size / 8, 8);
+            samples._add(bench_cycles() - t0);
+            op++;
+            if (!p) {
+                result.m_failed++;
+                continue;
+            }
+            bench_touch(p, size);
+            alloc.m_free(p);
+            op++;
+        }
+    }
+    result.m_seconds = bench_seconds() - start;
+    result.m_ops = op;
+    samples._finish(result);
+}
+
+// Larson-style server: each thread replaces random objects in its slot array;
+// after every round the arrays rotate between threads, so most objects are
+// freed by a different thread than the one that allocated them
+static void bench_larson(const BenchAllocator& alloc, const BenchCase& bench,
+                         double scale, BenchResult& result) {
+    const int threads = bench.m_threads;
+    const size_t slots = 256;
+    const int rounds = 20;
+    size_t ops_per_round = std::max<size_t>(1, (size_t)(50000 * scale));
+    std::vector<std::vector<void*>> arrays(threads, std::vector<void*>(slots, nullptr));
+    std::vector<LatencySamples> samples(threads);
+    std::atomic<uint64_t> failed(0);
+    std::atomic<int> arrived(0);
+
+    double start = bench_seconds();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            BenchRng rng(t + 1);
+            uint64_t op = 0;
+            for (int r = 0; r < rounds; r++) {
+                std::vector<void*>& live = arrays[(t + r) % threads];
+                for (size_t i = 0; i < ops_per_round; i++, op++) {
+                    size_t slot = rng._next() % slots;
+                    size_t size = rng._size(16, bench.m_param);
+                    void* p;
+                    TIMED(op, samples[t], alloc.m_free(live[slot]); p = alloc.m_malloc(size));
+                    live[slot] = p;
+                    if (!p) {
+                        failed++;
+                    } else {
+                        *(char*)p = 1;
+                    }
+                }
+                // Barrier: nobody picks up the next array before everyone is done
+                int target = (r + 1) * threads;
+                arrived++;
+                while (arrived.load() < target) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (std::thread& w : workers) {
+        w.join();
+    }
+    for (std::vector<void*>& live : arrays) {
+        for (void* p : live) {
+            alloc.m_free(p);
+        }
+    }
+    result.m_seconds = bench_seconds() - start;
+    result.m_ops = (uint64_t)threads * rounds * ops_per_round * 2;
+    result.m_failed = failed;
+    for (int t = 1; t < threads; t++) {
+        samples[0]._append(samples[t]);
+    }
+    samples[0]._finish(result);
+}
+
+// Independent threads doing small alloc/free batches: shows how throughput
+// scales (or collapses) with the thread count
+static void bench_mt_scaling(const BenchAllocator& alloc, const BenchCase& bench,
+                             double scale, BenchResult& result) {
+    const int threads = bench.m_threads;
+    const size_t batch = 64;
+    size_t rounds = std::max<size_t>(1, (size_t)(20000 * scale));
+    std::vector<LatencySamples> samples(threads);
+    std::atomic<uint64_t> failed(0);
+
+    double start = bench_seconds();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            void* ptrs[batch];
+            uint64_t op = 0;
+            for (size_t r = 0; r < rounds; r++) {
+                for (size_t i = 0; i < batch; i++, op++) {
+                    TIMED(op, samples[t], ptrs[i] = alloc.m_malloc(bench.m_param));
+                    if (!ptrs[i]) {
+                        failed++;
+                    }
+                }
+                for (size_t i = 0; i < batch; i++, op++) {
+                    TIMED(op, samples[t], alloc.m_free(ptrs[i]));
+                }
+            }
+        });
+    }
+    for (std::thread& w : workers) {
+        w.join();
+    }
+    result.m_seconds = bench_seconds() - start;
+    result.m_ops = (uint64_t)threads * rounds * batch * 2;
+    result.m_failed = failed;
+    for (int t = 1; t < threads; t++) {
+        samples[0]._append(samples[t]);
+    }
+    samples[0]._finish(result);
+}
+
+const std::vector<BenchCase>& bench_cases() {
+    static const std::vector<BenchCase> cases = {
+            {"size_16", bench_size_class, 16, 1, false, false},
+            {"size_64", bench_size_class, 64, 1, false, false},
+            {"size_256", bench_size_class, 256, 1, false, false},
+            {"size_1k", bench_size_class, 1024, 1, false, false},
+            {"size_4k", bench_size_class, 4096, 1, false, false},
+            {"size_16k", bench_size_class, 16 * 1024, 1, false, false},
+            {"size_64k", bench_size_class, 64 * 1024, 1, false, false},
+            {"size_256k", bench_size_class, 256 * 1024, 1, false, false},
+            {"churn", bench_churn, 4096, 1, true, false},
+            {"large_churn", bench_large_churn, 512 * 1024, 1, true, false},
+            {"ping_pong", bench_ping_pong, 64, 1, true, false},
+            {"cold_free", bench_cold_free, 64, 1, true, false},
+            {"cold_free_sized", bench_cold_free_sized, 64, 1, true, true},
+            {"realloc_growth", bench_realloc_growth, 64 * 1024, 1, true, false},
+            {"realloc_random", bench_realloc_random, 8 * 1024, 1, true, false},
+            {"scalloc_large", bench_scalloc_large, 64 * 1024 * 1024, 1, true, false},
+            {"larson_4t", bench_larson, 512, 4, true, false},
+            {"mt_scaling_1t", bench_mt_scaling, 64, 1, true, false},
+            {"mt_scaling_2t", bench_mt_scaling, 64, 2, true, false},
+            {"mt_scaling_4t", bench_mt_scaling, 64, 4, true, false},
+            {"mt_scaling_8t", bench_mt_scaling, 64, 8, true, false},
+    };
+    return cases;
+}
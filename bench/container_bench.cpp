@@ -0,0 +1,182 @@
+// Standard containers on malloc_3 through smalloc_allocator.h, against the
+// same containers on std::allocator (global new, i.e. glibc):
+//   container_bench [--scale X] [--filter substring] [--no-header]
+// Prints allocator,benchmark,ops,seconds,ops_per_sec rows. Every round builds
+// and destroys its containers, so each case ends with an empty heap; sizes
+// are kept well inside malloc_3's 4MB buddy pool.
+#include "../smalloc_allocator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+#define CONTAINER_ELEMENTS 4096
+#define VECTOR_ELEMENTS 8192 // Grows through every order up to a 64KB buffer
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static std::vector<uint64_t> make_keys(size_t n) {
+    std::vector<uint64_t> keys(n);
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < n; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        keys[i] = x;
+    }
+    return keys;
+}
+
+static volatile uint64_t sink;
+
+template <class Vector, class AllocArg>
+static uint64_t vector_push(AllocArg alloc, const std::vector<uint64_t>& keys, int rounds) {
+    uint64_t ops = 0;
+    for (int r = 0; r < rounds; r++) {
+        Vector v(alloc);
+        for (int i = 0; i < VECTOR_ELEMENTS; i++) {
+            v.push_back(i);
+        }
+        sink = v.back();
+        ops += VECTOR_ELEMENTS;
+    }
+    (void)keys;
+    return ops;
+}
+
+template <class Map, class AllocArg>
+static uint64_t map_insert_erase(AllocArg alloc, const std::vector<uint64_t>& keys, int rounds) {
+    uint64_t ops = 0;
+    for (int r = 0; r < rounds; r++) {
+        Map m(alloc);
+        for (uint64_t k : keys) {
+            m.emplace(k, k);
+        }
+        for (uint64_t k : keys) {
+            m.erase(k);
+        }
+        ops += 2 * keys.size();
+    }
+    return ops;
+}
+
+template <class Map, class AllocArg>
+static uint64_t unordered_map_mixed(AllocArg alloc, const std::vector<uint64_t>& keys, int rounds) {
+    uint64_t ops = 0;
+    for (int r = 0; r < rounds; r++) {
+        Map m(alloc);
+        for (uint64_t k : keys) {
+            m.emplace(k, k);
+        }
+        uint64_t found = 0;
+        for (uint64_t k : keys) {
+            found += m.count(k);
+        }
+        sink = found;
+        for (uint64_t k : keys) {
+            m.erase(k);
+        }
+        ops += 3 * keys.size();
+    }
+    return ops;
+}
+
+typedef std::pair<const uint64_t, uint64_t> MapValue;
+typedef std::less<uint64_t> KeyLess;
+typedef std::hash<uint64_t> KeyHash;
+typedef std::equal_to<uint64_t> KeyEqual;
+
+template <template <class> class Alloc>
+struct Containers {
+    typedef std::vector<uint64_t, Alloc<uint64_t>> Vector;
+    typedef std::map<uint64_t, uint64_t, KeyLess, Alloc<MapValue>> Map;
+    typedef std::unordered_map<uint64_t, uint64_t, KeyHash, KeyEqual, Alloc<MapValue>> UnorderedMap;
+};
+
+typedef Containers<std::allocator> StdContainers;
+typedef Containers<SmallocAllocator> SmallocContainers;
+typedef Containers<std::pmr::polymorphic_allocator> PmrContainers;
+
+typedef uint64_t (*ContainerFn)(const std::vector<uint64_t>& keys, int rounds);
+
+struct ContainerCase {
+    const char* m_allocator;
+    const char* m_name;
+    ContainerFn m_fn;
+    int m_rounds;
+};
+
+static const ContainerCase cases[] = {
+        {"std_allocator", "vector_push", [](const std::vector<uint64_t>& k, int r) {
+            return vector_push<StdContainers::Vector>(std::allocator<uint64_t>(), k, r); }, 2000},
+        {"smalloc_allocator", "vector_push", [](const std::vector<uint64_t>& k, int r) {
+            return vector_push<SmallocContainers::Vector>(SmallocAllocator<uint64_t>(), k, r); }, 2000},
+        {"pmr_new_delete", "vector_push", [](const std::vector<uint64_t>& k, int r) {
+            return vector_push<PmrContainers::Vector>(std::pmr::new_delete_resource(), k, r); }, 2000},
+        {"pmr_smalloc", "vector_push", [](const std::vector<uint64_t>& k, int r) {
+            return vector_push<PmrContainers::Vector>(smalloc_resource(), k, r); }, 2000},
+
+        {"std_allocator", "map_insert_erase", [](const std::vector<uint64_t>& k, int r) {
+            return map_insert_erase<StdContainers::Map>(std::allocator<MapValue>(), k, r); }, 100},
+        {"smalloc_allocator", "map_insert_erase", [](const std::vector<uint64_t>& k, int r) {
+            return map_insert_erase<SmallocContainers::Map>(SmallocAllocator<MapValue>(), k, r); }, 100},
+        {"pmr_new_delete", "map_insert_erase", [](const std::vector<uint64_t>& k, int r) {
+            return map_insert_erase<PmrContainers::Map>(std::pmr::new_delete_resource(), k, r); }, 100},
+        {"pmr_smalloc", "map_insert_erase", [](const std::vector<uint64_t>& k, int r) {
+            return map_insert_erase<PmrContainers::Map>(smalloc_resource(), k, r); }, 100},
+
+        {"std_allocator", "unordered_map_mixed", [](const std::vector<uint64_t>& k, int r) {
+            return unordered_map_mixed<StdContainers::UnorderedMap>(std::allocator<MapValue>(), k, r); }, 100},
+        {"smalloc_allocator", "unordered_map_mixed", [](const std::vector<uint64_t>& k, int r) {
+            return unordered_map_mixed<SmallocContainers::UnorderedMap>(SmallocAllocator<MapValue>(), k, r); }, 100},
+        {"pmr_new_delete", "unordered_map_mixed", [](const std::vector<uint64_t>& k, int r) {
+            return unordered_map_mixed<PmrContainers::UnorderedMap>(std::pmr::new_delete_resource(), k, r); }, 100},
+        {"pmr_smalloc", "unordered_map_mixed", [](const std::vector<uint64_t>& k, int r) {
+            return unordered_map_mixed<PmrContainers::UnorderedMap>(smalloc_resource(), k, r); }, 100},
+};
+
+int main(int argc, char** argv) {
+    double scale = 1.0;
+    const char* filter = nullptr;
+    bool header = true;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--no-header") == 0) {
+            header = false;
+        } else {
+            fprintf(stderr, "usage: %s [--scale X] [--filter substring] [--no-header]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<uint64_t> keys = make_keys(CONTAINER_ELEMENTS);
+    if (header) {
+        printf("allocator,benchmark,ops,seconds,ops_per_sec\n");
+    }
+    for (const ContainerCase& c : cases) {
+        if (filter && !strstr(c.m_name, filter)) {
+            continue;
+        }
+        int rounds = (int)(c.m_rounds * scale) > 0 ? (int)(c.m_rounds * scale) : 1;
+        double start = now_seconds();
+        uint64_t ops = c.m_fn(keys, rounds);
+        double seconds = now_seconds() - start;
+        printf("%s,%s,%llu,%.6f,%.0f\n", c.m_allocator, c.m_name, (unsigned long long)ops,
+               seconds, seconds > 0 ? ops / seconds : 0);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,201 @@
+// Page placement on NUMA machines: for every online memory node, a thread
+// pinned to that node's CPUs allocates and touches a batch of blocks, then
+// asks the kernel which node backs each block's first page. Blocks on the
+// thread's own node count as local, the rest as remote. Compares glibc
+// malloc with malloc_3, whose arenas bind their memory to the node they
+// serve:
+//   numa_bench [--scale X] [--no-header]
+// Prints allocator,node,objects,local,remote,local_pct,seconds rows. On a
+// single-node machine every block is local for both allocators.
+#include "../smalloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <vector>
+
+#define MAX_NODES 64
+#define LARGE_EVERY 100 // One object in LARGE_EVERY is 160-400 KB and mmapped
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Reads a sysfs list such as "0-3,8,10-11" into `ids`
+static int read_list(const char* path, int* ids, int max) {
+    char buf[4096];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = '\0';
+
+    int count = 0;
+    for (char* cur = buf; *cur >= '0' && *cur <= '9';) {
+        int first = (int)strtol(cur, &cur, 10);
+        int last = *cur == '-' ? (int)strtol(cur + 1, &cur, 10) : first;
+        for (int id = first; id <= last && count < max; id++) {
+            ids[count++] = id;
+        }
+        if (*cur == ',') {
+            cur++;
+        }
+    }
+    return count;
+}
+
+// Restricts the calling thread to the CPUs of `node`
+static bool pin_to_node(int node) {
+    char path[64];
+    int cpus[CPU_SETSIZE];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    int count = read_list(path, cpus, CPU_SETSIZE);
+    if (count == 0) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < count; i++) {
+        CPU_SET(cpus[i], &set);
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// Node backing the page at `p`, or -1 if the kernel cannot tell
+static int node_of(void* p) {
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, nullptr, 0, p, MPOL_F_NODE | MPOL_F_ADDR) != 0) {
+        return -1;
+    }
+    return node;
+}
+
+// Precomputed so every allocator sees the same sizes
+static std::vector<size_t> make_sizes(size_t n) {
+    std::vector<size_t> sizes(n);
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < n; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        if (i % LARGE_EVERY == LARGE_EVERY - 1) {
+            sizes[i] = 160 * 1024 + x % (240 * 1024);
+        } else {
+            sizes[i] = 16 + x % 500;
+        }
+    }
+    return sizes;
+}
+
+struct NodeRun {
+    int m_node;
+    bool m_use_smalloc;
+    const std::vector<size_t>* m_sizes;
+    uint64_t m_local;
+    uint64_t m_remote;
+    double m_seconds;
+};
+
+static void* run_node(void* arg) {
+    NodeRun* run = static_cast<NodeRun*>(arg);
+    if (!pin_to_node(run->m_node)) {
+        return nullptr;
+    }
+    const std::vector<size_t>& sizes = *run->m_sizes;
+    std::vector<void*> ptrs(sizes.size());
+    double start = now_seconds();
+    for (size_t i = 0; i < sizes.size(); i++) {
+        ptrs[i] = run->m_use_smalloc ? smalloc(sizes[i]) : malloc(sizes[i]);
+        if (ptrs[i]) {
+            memset(ptrs[i], 1, sizes[i]);
+        }
+    }
+    run->m_seconds = now_seconds() - start;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        if (!ptrs[i]) {
+            continue;
+        }
+        if (node_of(ptrs[i]) == run->m_node) {
+            run->m_local++;
+        } else {
+            run->m_remote++;
+        }
+    }
+    for (size_t i = 0; i < sizes.size(); i++) {
+        if (run->m_use_smalloc) {
+            sfree(ptrs[i]);
+        } else {
+            free(ptrs[i]);
+        }
+    }
+    return nullptr;
+}
+
+struct AllocatorCase {
+    const char* m_allocator;
+    bool m_use_smalloc;
+};
+
+static const AllocatorCase cases[] = {
+        {"glibc", false},
+        {"malloc_3", true},
+};
+
+int main(int argc, char** argv) {
+    double scale = 1.0;
+    bool header = true;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--no-header") == 0) {
+            header = false;
+        } else {
+            fprintf(stderr, "usage: %s [--scale X] [--no-header]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    int nodes[MAX_NODES];
+    int num_nodes = read_list("/sys/devices/system/node/online", nodes, MAX_NODES);
+    if (num_nodes == 0) {
+        nodes[0] = 0;
+        num_nodes = 1;
+    }
+    // The default batch fits in the base 4 MB of each malloc_3 arena's pool
+    size_t objects = (size_t)(4000 * scale) > 0 ? (size_t)(4000 * scale) : 1;
+    std::vector<size_t> sizes = make_sizes(objects);
+
+    if (header) {
+        printf("allocator,node,objects,local,remote,local_pct,seconds\n");
+    }
+    for (const AllocatorCase& c : cases) {
+        for (int n = 0; n < num_nodes; n++) {
+            NodeRun run = {nodes[n], c.m_use_smalloc, &sizes, 0, 0, 0.0};
+            pthread_t thread;
+            if (pthread_create(&thread, nullptr, run_node, &run) != 0) {
+                return 1;
+            }
+            pthread_join(thread, nullptr);
+            uint64_t placed = run.m_local + run.m_remote;
+            printf("%s,%d,%zu,%llu,%llu,%.1f,%.6f\n", c.m_allocator, run.m_node, objects,
+                   (unsigned long long)run.m_local, (unsigned long long)run.m_remote,
+                   placed ? 100.0 * run.m_local / placed : 0.0, run.m_seconds);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
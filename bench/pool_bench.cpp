@@ -0,0 +1,132 @@
+// Fixed-size objects on malloc_3: ObjectPool with and without the per-thread
+// cache, against smalloc/sfree with placement new and against new/delete
+// (glibc):
+//   pool_bench [--scale X] [--no-header]
+// Every thread creates a batch of list-node-sized objects and destroys it
+// again, repeatedly. Prints allocator,benchmark,threads,ops,seconds,ops_per_sec.
+#include "../object_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <new>
+#include <thread>
+#include <vector>
+
+#define BATCH 1000
+
+struct Node {
+    Node* m_next;
+    Node* m_prev;
+    uint64_t m_key;
+    uint64_t m_value[3];
+    explicit Node(uint64_t key) : m_next(nullptr), m_prev(nullptr), m_key(key), m_value() {}
+};
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static volatile uint64_t sink;
+
+static ObjectPool<Node> pool;
+static ObjectPool<Node, POOL_MAX_CHUNK_ORDER, true> cached_pool;
+
+struct NewDelete {
+    static Node* _create(uint64_t key) { return new Node(key); }
+    static void _destroy(Node* n) { delete n; }
+};
+
+struct Smalloc {
+    static Node* _create(uint64_t key) {
+        void* p = smalloc(sizeof(Node));
+        return p ? new (p) Node(key) : nullptr;
+    }
+    static void _destroy(Node* n) {
+        n->~Node();
+        sfree(n);
+    }
+};
+
+struct Pool {
+    static Node* _create(uint64_t key) { return pool._create(key); }
+    static void _destroy(Node* n) { pool._destroy(n); }
+};
+
+struct CachedPool {
+    static Node* _create(uint64_t key) { return cached_pool._create(key); }
+    static void _destroy(Node* n) { cached_pool._destroy(n); }
+};
+
+template <class Alloc>
+static void worker(size_t rounds) {
+    Node* nodes[BATCH];
+    uint64_t sum = 0;
+    for (size_t r = 0; r < rounds; r++) {
+        for (int i = 0; i < BATCH; i++) {
+            nodes[i] = Alloc::_create(i);
+        }
+        for (int i = 0; i < BATCH; i++) {
+            if (nodes[i]) {
+                sum += nodes[i]->m_key;
+                Alloc::_destroy(nodes[i]);
+            }
+        }
+    }
+    sink = sum;
+}
+
+typedef void (*WorkerFn)(size_t rounds);
+
+struct PoolCase {
+    const char* m_allocator;
+    WorkerFn m_fn;
+};
+
+static const PoolCase cases[] = {
+        {"new_delete", worker<NewDelete>},
+        {"smalloc", worker<Smalloc>},
+        {"object_pool", worker<Pool>},
+        {"object_pool_cached", worker<CachedPool>},
+};
+
+int main(int argc, char** argv) {
+    double scale = 1.0;
+    bool header = true;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--no-header") == 0) {
+            header = false;
+        } else {
+            fprintf(stderr, "usage: %s [--scale X] [--no-header]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    size_t rounds = (size_t)(2000 * scale) > 0 ? (size_t)(2000 * scale) : 1;
+    if (header) {
+        printf("allocator,benchmark,threads,ops,seconds,ops_per_sec\n");
+    }
+    for (int threads : {1, 4}) {
+        for (const PoolCase& c : cases) {
+            double start = now_seconds();
+            std::vector<std::thread> workers;
+            for (int t = 0; t < threads; t++) {
+                workers.emplace_back(c.m_fn, rounds);
+            }
+            for (std::thread& w : workers) {
+                w.join();
+            }
+            double seconds = now_seconds() - start;
+            uint64_t ops = (uint64_t)threads * rounds * BATCH * 2;
+            printf("%s,node_batch,%d,%llu,%.6f,%.0f\n", c.m_allocator, threads,
+                   (unsigned long long)ops, seconds, seconds > 0 ? ops / seconds : 0);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
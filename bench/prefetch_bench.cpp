@@ -0,0 +1,175 @@
+// Allocation from a long, scattered free list with cold caches, for malloc_3
+// built with each SMALLOC_PREFETCH level:
+//   prefetch_bench [--scale X] [--no-header]
+// Each round fills the pool with small blocks, frees a random subset of them
+// (one block of a buddy pair at most, so nothing merges and the order-0 free
+// list holds thousands of blocks spread over the pool), evicts the caches,
+// and then times allocating the free list back while writing every block.
+// Cache misses and cycles come from perf counters when the kernel allows it
+// (-1 otherwise). Prints allocator,benchmark,ops,seconds,ns_per_op,
+// cache_misses_per_op,cycles_per_op rows.
+#include "../smalloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <algorithm>
+#include <vector>
+
+SMALLOC_DECLARE_API(malloc_3)
+SMALLOC_DECLARE_API(malloc_3_noprefetch)
+SMALLOC_DECLARE_API(malloc_3_prefetch2)
+
+#define OBJECT_SIZE 80        // An order-0 block (128 bytes) with the header
+#define POOL_OBJECTS 28000    // Most of the 4 MB pool
+#define MIN_BLOCK 128
+#define EVICT_BYTES (64 << 20) // Larger than the last-level cache
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// A user-space hardware counter of the calling thread, or -1
+static int open_counter(uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t read_counter(int fd) {
+    uint64_t value = 0;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+        return 0;
+    }
+    return value;
+}
+
+static volatile uint64_t sink;
+
+static void evict_caches(std::vector<char>& buffer) {
+    for (size_t i = 0; i < buffer.size(); i += 64) {
+        buffer[i]++;
+    }
+    sink += buffer[buffer.size() / 2];
+}
+
+struct PrefetchCase {
+    const char* m_allocator;
+    void* (*m_alloc)(size_t);
+    void (*m_free)(void*);
+};
+
+static const PrefetchCase cases[] = {
+        {"malloc_3_noprefetch", malloc_3_noprefetch::smalloc, malloc_3_noprefetch::sfree},
+        {"malloc_3", malloc_3::smalloc, malloc_3::sfree},
+        {"malloc_3_prefetch2", malloc_3_prefetch2::smalloc, malloc_3_prefetch2::sfree},
+};
+
+int main(int argc, char** argv) {
+    double scale = 1.0;
+    bool header = true;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--no-header") == 0) {
+            header = false;
+        } else {
+            fprintf(stderr, "usage: %s [--scale X] [--no-header]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    size_t rounds = (size_t)(50 * scale) > 0 ? (size_t)(50 * scale) : 1;
+    std::vector<char> evict(EVICT_BYTES);
+    int misses_fd = open_counter(PERF_COUNT_HW_CACHE_MISSES);
+    int cycles_fd = open_counter(PERF_COUNT_HW_CPU_CYCLES);
+
+    if (header) {
+        printf("allocator,benchmark,ops,seconds,ns_per_op,cache_misses_per_op,cycles_per_op\n");
+    }
+    for (const PrefetchCase& c : cases) {
+        std::vector<void*> live;
+        std::vector<void*> freed;
+        uint64_t x = 0x9E3779B97F4A7C15ull;
+        uint64_t ops = 0;
+        uint64_t misses = 0;
+        uint64_t cycles = 0;
+        double seconds = 0;
+        for (size_t r = 0; r < rounds; r++) {
+            live.clear();
+            for (int i = 0; i < POOL_OBJECTS; i++) {
+                void* p = c.m_alloc(OBJECT_SIZE);
+                if (p) {
+                    live.push_back(p);
+                }
+            }
+            // Freed in address order, so each free appends to the sorted list
+            std::sort(live.begin(), live.end());
+            freed.clear();
+            for (void*& p : live) {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                if ((reinterpret_cast<uintptr_t>(p) / MIN_BLOCK) % 2 == 0 && x % 4 != 0) {
+                    c.m_free(p);
+                    freed.push_back(p);
+                    p = nullptr;
+                }
+            }
+            evict_caches(evict);
+
+            ioctl(misses_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(cycles_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+            ioctl(cycles_fd, PERF_EVENT_IOC_ENABLE, 0);
+            double start = now_seconds();
+            for (size_t i = 0; i < freed.size(); i++) {
+                void* p = c.m_alloc(OBJECT_SIZE);
+                if (p) {
+                    memset(p, (int)i, OBJECT_SIZE);
+                }
+                freed[i] = p;
+            }
+            seconds += now_seconds() - start;
+            ioctl(misses_fd, PERF_EVENT_IOC_DISABLE, 0);
+            ioctl(cycles_fd, PERF_EVENT_IOC_DISABLE, 0);
+            misses += read_counter(misses_fd);
+            cycles += read_counter(cycles_fd);
+            ops += freed.size();
+
+            for (void* p : freed) {
+                c.m_free(p);
+            }
+            for (void* p : live) {
+                c.m_free(p);
+            }
+        }
+        printf("%s,scattered_free_list,%llu,%.6f,%.1f,", c.m_allocator, (unsigned long long)ops,
+               seconds, seconds * 1e9 / ops);
+        if (misses_fd >= 0) {
+            printf("%.2f,", (double)misses / ops);
+        } else {
+            printf("-1,");
+        }
+        if (cycles_fd >= 0) {
+            printf("%.1f\n", (double)cycles / ops);
+        } else {
+            printf("-1\n");
+        }
+        fflush(stdout);
+    }
+    return 0;
+}
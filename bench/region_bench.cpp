@@ -0,0 +1,141 @@
+// A request-scoped workload on malloc_3: every request allocates a few
+// hundred small objects (and now and then a large one), uses them, and drops
+// them all at the end. Compares per-object smalloc/sfree, a region reset per
+// request, and glibc malloc/free:
+//   region_bench [--scale X] [--no-header]
+// Prints allocator,benchmark,requests,objects,seconds,ns_per_object rows.
+#include "../smalloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+#define OBJECTS_PER_REQUEST 300
+#define LARGE_EVERY 50 // One object in LARGE_EVERY is 8-64 KB
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Precomputed so every variant sees the same sizes
+static std::vector<size_t> make_sizes(size_t n) {
+    std::vector<size_t> sizes(n);
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < n; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        if (i % LARGE_EVERY == LARGE_EVERY - 1) {
+            sizes[i] = 8192 + x % (56 * 1024);
+        } else {
+            int bits = 4 + (int)(x % 6); // 16 .. 1023 bytes, log-uniform
+            sizes[i] = ((size_t)1 << bits) + (x >> 8) % ((size_t)1 << bits);
+        }
+    }
+    return sizes;
+}
+
+typedef uint64_t (*RequestFn)(const std::vector<size_t>& sizes, size_t requests);
+
+static uint64_t run_malloc(const std::vector<size_t>& sizes, size_t requests) {
+    void* ptrs[OBJECTS_PER_REQUEST];
+    uint64_t failed = 0;
+    for (size_t r = 0; r < requests; r++) {
+        for (int i = 0; i < OBJECTS_PER_REQUEST; i++) {
+            ptrs[i] = malloc(sizes[i]);
+            if (!ptrs[i]) {
+                failed++;
+            } else {
+                *(char*)ptrs[i] = 1;
+            }
+        }
+        for (int i = 0; i < OBJECTS_PER_REQUEST; i++) {
+            free(ptrs[i]);
+        }
+    }
+    return failed;
+}
+
+static uint64_t run_smalloc(const std::vector<size_t>& sizes, size_t requests) {
+    void* ptrs[OBJECTS_PER_REQUEST];
+    uint64_t failed = 0;
+    for (size_t r = 0; r < requests; r++) {
+        for (int i = 0; i < OBJECTS_PER_REQUEST; i++) {
+            ptrs[i] = smalloc(sizes[i]);
+            if (!ptrs[i]) {
+                failed++;
+            } else {
+                *(char*)ptrs[i] = 1;
+            }
+        }
+        for (int i = 0; i < OBJECTS_PER_REQUEST; i++) {
+            sfree(ptrs[i]);
+        }
+    }
+    return failed;
+}
+
+static uint64_t run_region(const std::vector<size_t>& sizes, size_t requests) {
+    Region* region = region_create();
+    uint64_t failed = 0;
+    for (size_t r = 0; r < requests; r++) {
+        for (int i = 0; i < OBJECTS_PER_REQUEST; i++) {
+            void* p = region_alloc(region, sizes[i]);
+            if (!p) {
+                failed++;
+            } else {
+                *(char*)p = 1;
+            }
+        }
+        region_reset(region);
+    }
+    region_destroy(region);
+    return failed;
+}
+
+struct RequestCase {
+    const char* m_allocator;
+    RequestFn m_fn;
+};
+
+static const RequestCase cases[] = {
+        {"glibc", run_malloc},
+        {"malloc_3", run_smalloc},
+        {"malloc_3_region", run_region},
+};
+
+int main(int argc, char** argv) {
+    double scale = 1.0;
+    bool header = true;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--no-header") == 0) {
+            header = false;
+        } else {
+            fprintf(stderr, "usage: %s [--scale X] [--no-header]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<size_t> sizes = make_sizes(OBJECTS_PER_REQUEST);
+    size_t requests = (size_t)(20000 * scale) > 0 ? (size_t)(20000 * scale) : 1;
+    if (header) {
+        printf("allocator,benchmark,requests,objects,seconds,ns_per_object,failed\n");
+    }
+    for (const RequestCase& c : cases) {
+        double start = now_seconds();
+        uint64_t failed = c.m_fn(sizes, requests);
+        double seconds = now_seconds() - start;
+        uint64_t objects = (uint64_t)requests * OBJECTS_PER_REQUEST;
+        printf("%s,request_scoped,%zu,%llu,%.6f,%.1f,%llu\n", c.m_allocator, requests,
+               (unsigned long long)objects, seconds, seconds * 1e9 / objects,
+               (unsigned long long)failed);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,110 @@
+// Large zeroed arrays on malloc_4: scalloc, which leaves zeroing fresh
+// mappings to the kernel, scalloc_populate, which pre-faults them, the old
+// behaviour of clearing the whole array up front, and glibc calloc:
+//   scalloc_bench [--scale X] [--no-header]
+// For arrays of 64 MB to 1 GB, first_use_ms is the time until the call
+// returned and the first byte was written; total_ms adds writing every page
+// once and freeing the array. Each figure is the mean of REPEATS runs.
+// Prints allocator,bytes,first_use_ms,total_ms rows.
+#include "../smalloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define REPEATS 3
+#define PAGE 4096
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void* glibc_calloc(size_t bytes) {
+    return calloc(bytes, 1);
+}
+
+static void* malloc_4_scalloc(size_t bytes) {
+    return scalloc(bytes, 1);
+}
+
+static void* malloc_4_populate(size_t bytes) {
+    return scalloc_populate(bytes, 1);
+}
+
+// What scalloc used to cost: every page faulted in and cleared in the call
+static void* malloc_4_memset(size_t bytes) {
+    void* p = scalloc(bytes, 1);
+    if (p) {
+        memset(p, 0, bytes);
+    }
+    return p;
+}
+
+struct ZeroedCase {
+    const char* m_allocator;
+    void* (*m_alloc)(size_t);
+    void (*m_free)(void*);
+};
+
+static const ZeroedCase cases[] = {
+        {"glibc", glibc_calloc, free},
+        {"malloc_4_memset", malloc_4_memset, sfree},
+        {"malloc_4", malloc_4_scalloc, sfree},
+        {"malloc_4_populate", malloc_4_populate, sfree},
+};
+
+int main(int argc, char** argv) {
+    double scale = 1.0;
+    bool header = true;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--no-header") == 0) {
+            header = false;
+        } else {
+            fprintf(stderr, "usage: %s [--scale X] [--no-header]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (header) {
+        printf("allocator,bytes,first_use_ms,total_ms\n");
+    }
+    for (size_t mb = 64; mb <= 1024; mb *= 2) {
+        size_t bytes = (size_t)(mb * scale * 1024 * 1024);
+        if (bytes < PAGE) {
+            bytes = PAGE;
+        }
+        for (const ZeroedCase& c : cases) {
+            double first_use = 0;
+            double total = 0;
+            bool failed = false;
+            for (int r = 0; r < REPEATS && !failed; r++) {
+                double start = now_seconds();
+                volatile char* p = static_cast<char*>(c.m_alloc(bytes));
+                if (!p) {
+                    failed = true;
+                    break;
+                }
+                p[0] = 1;
+                first_use += now_seconds() - start;
+                for (size_t i = PAGE; i < bytes; i += PAGE) {
+                    p[i] = 1;
+                }
+                c.m_free(const_cast<char*>(p));
+                total += now_seconds() - start;
+            }
+            if (failed) {
+                printf("%s,%zu,-1,-1\n", c.m_allocator, bytes);
+            } else {
+                printf("%s,%zu,%.3f,%.3f\n", c.m_allocator, bytes, first_use * 1e3 / REPEATS,
+                       total * 1e3 / REPEATS);
+            }
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,348 @@
+#ifndef GUARDED_POOL_H
+#define GUARDED_POOL_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#define GUARDED_PAGE_SIZE 4096
+#define GUARDED_SLOTS 64           // Sampled blocks alive at once, each on its own page
+#define GUARDED_ALIGNMENT 16       // Blocks end as close to the next guard page as this allows
+#define GUARDED_MAX_DEPTH 16       // Frames kept per allocation and free
+#define GUARDED_SKIP_FRAMES 1      // _allocate()/_deallocate() itself
+#define GUARDED_RECHECK_CALLS 65536 // Calls between looks at the rate while sampling is off
+#define GUARDED_MAX_POOLS 8        // Pools the fault handler knows about (one per variant)
+
+// Per-thread countdown to the next sampled allocation. Every allocator keeps
+// its own thread_local copy, starting at 1 so the first call draws a gap.
+struct GuardedThreadState {
+    size_t m_countdown;
+    uint64_t m_rng; // 0 until the thread draws its first gap
+};
+
+struct GuardedStack {
+    int m_depth;
+    pid_t m_tid;
+    void* m_frames[GUARDED_MAX_DEPTH];
+};
+
+// Metadata of one slot, kept outside the guarded pages
+struct GuardedSlot {
+    uintptr_t m_ptr; // 0 while the slot was never used
+    size_t m_size;
+    bool m_live;
+    GuardedStack m_alloc;
+    GuardedStack m_free;
+};
+
+// GWP-ASan style guard pages: a sampled allocation gets a page of its own
+// between two inaccessible pages, placed at the end of the page so that an
+// overflow faults on the next guard page. A freed page is made inaccessible
+// too, and slots are reused round robin so it stays that way for as long as
+// possible. A fault inside the pool is reported on stderr with the stacks of
+// the block's allocation and free, and then handed to the previous SIGSEGV
+// handler (by default: the process dies with a core dump).
+//
+// The pool is mmapped when sampling is first turned on; nothing here
+// allocates from the heap. Blocks up to a page are sampled; larger requests
+// and requests finding every slot in use go to the heap as usual.
+class GuardedPool {
+private:
+    struct Registry {
+        std::atomic<GuardedPool*> m_pools[GUARDED_MAX_POOLS];
+        struct sigaction m_previous;
+        bool m_installed;
+        pthread_mutex_t m_lock = PTHREAD_MUTEX_INITIALIZER;
+    };
+
+    std::atomic<size_t> _rate; // Mean smalloc calls between samples, 0 disables
+    std::atomic<uintptr_t> _start;
+    std::atomic<uintptr_t> _end;
+    size_t _next_slot;
+    GuardedSlot _slots[GUARDED_SLOTS];
+    pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+
+    static Registry& _registry();
+    static void _on_fault(int sig, siginfo_t* info, void* context);
+    static void _capture(GuardedStack& stack);
+    static void _print(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+    static void _print_stack(const char* what, const GuardedStack& stack);
+
+    bool _map_pool();
+    uintptr_t _page(size_t slot) const;
+    GuardedSlot* _slot_of(uintptr_t addr);
+    void _report(uintptr_t addr);
+
+public:
+    GuardedPool() : _rate(0), _start(0), _end(0), _next_slot(0), _slots() {}
+    GuardedPool(const GuardedPool&) = delete;
+    GuardedPool& operator=(const GuardedPool&) = delete;
+
+    // The only check on the free path
+    bool _owns(const void* p) const {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+        return addr >= _start.load(std::memory_order_relaxed) && addr < _end.load(std::memory_order_relaxed);
+    }
+
+    // False when the pool or the fault handler cannot be set up
+    bool _set_rate(size_t calls);
+    size_t _get_rate() const;
+    size_t _next_countdown(GuardedThreadState& state) const;
+
+    // nullptr when the block is too large or every slot is in use
+    void* _allocate(size_t size);
+    // Aborts with a report on a double or invalid free
+    void _deallocate(void* p);
+    // Requested size of a live block, 0 for anything else
+    size_t _size(const void* p);
+
+    void _prefork();
+    void _postfork_parent();
+    void _postfork_child();
+};
+
+inline GuardedPool::Registry& GuardedPool::_registry() {
+    static Registry registry;
+    return registry;
+}
+
+inline uintptr_t GuardedPool::_page(size_t slot) const {
+    // Page 0 is a guard, then slot pages and guards alternate
+    return _start.load(std::memory_order_relaxed) + (2 * slot + 1) * GUARDED_PAGE_SIZE;
+}
+
+// Slot whose page, or a guard page next to it, holds `addr`. A guard page
+// between two slots goes to the left one if it was used, since blocks sit at
+// the end of their page and overflows are more common than underflows.
+inline GuardedSlot* GuardedPool::_slot_of(uintptr_t addr) {
+    size_t page = (addr - _start.load(std::memory_order_relaxed)) / GUARDED_PAGE_SIZE;
+    if (page % 2) {
+        return &_slots[page / 2];
+    }
+    GuardedSlot* left = page > 0 ? &_slots[page / 2 - 1] : nullptr;
+    GuardedSlot* right = page / 2 < GUARDED_SLOTS ? &_slots[page / 2] : nullptr;
+    return left && (left->m_ptr || !right) ? left : right;
+}
+
+inline void GuardedPool::_capture(GuardedStack& stack) {
+    void* frames[GUARDED_MAX_DEPTH + GUARDED_SKIP_FRAMES];
+    int depth = backtrace(frames, GUARDED_MAX_DEPTH + GUARDED_SKIP_FRAMES) - GUARDED_SKIP_FRAMES;
+    stack.m_depth = depth > 0 ? depth : 0;
+    memcpy(stack.m_frames, frames + GUARDED_SKIP_FRAMES, stack.m_depth * sizeof(void*));
+    stack.m_tid = (pid_t)syscall(SYS_gettid);
+}
+
+// Formats into a stack buffer and writes to stderr, so it can run inside the
+// fault handler and under the heap lock
+inline void GuardedPool::_print(const char* fmt, ...) {
+    char msg[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    if (len > 0) {
+        ssize_t ignored = write(STDERR_FILENO, msg, (size_t)len < sizeof(msg) ? (size_t)len : sizeof(msg) - 1);
+        (void)ignored;
+    }
+}
+
+inline void GuardedPool::_print_stack(const char* what, const GuardedStack& stack) {
+    _print("%s by thread %d:\n", what, (int)stack.m_tid);
+    backtrace_symbols_fd(stack.m_frames, stack.m_depth, STDERR_FILENO);
+}
+
+inline void GuardedPool::_report(uintptr_t addr) {
+    GuardedSlot* slot = _slot_of(addr);
+    if (!slot || !slot->m_ptr) {
+        _print("smalloc guard: fault at %p in the guarded pool, no block nearby\n", (void*)addr);
+        return;
+    }
+    const char* kind;
+    if (!slot->m_live) {
+        kind = "use after free";
+    } else if (addr >= slot->m_ptr + slot->m_size) {
+        kind = "buffer overflow";
+    } else {
+        kind = "buffer underflow";
+    }
+    long offset = (long)(addr - slot->m_ptr);
+    _print("smalloc guard: %s at %p, %ld bytes from the start of a %zu-byte block at %p\n",
+           kind, (void*)addr, offset, slot->m_size, (void*)slot->m_ptr);
+    _print_stack("allocated", slot->m_alloc);
+    if (!slot->m_live) {
+        _print_stack("freed", slot->m_free);
+    }
+}
+
+// Reports faults inside any registered pool, then restores the previous
+// handler and returns: the access faults again and is handled as if we had
+// never been installed
+inline void GuardedPool::_on_fault(int sig, siginfo_t* info, void* context) {
+    (void)context;
+    Registry& registry = _registry();
+    uintptr_t addr = reinterpret_cast<uintptr_t>(info->si_addr);
+    for (int i = 0; i < GUARDED_MAX_POOLS; i++) {
+        GuardedPool* pool = registry.m_pools[i].load(std::memory_order_acquire);
+        if (pool && pool->_owns(info->si_addr)) {
+            pool->_report(addr);
+            break;
+        }
+    }
+    sigaction(sig, &registry.m_previous, nullptr);
+}
+
+inline bool GuardedPool::_map_pool() {
+    size_t bytes = (2 * GUARDED_SLOTS + 1) * GUARDED_PAGE_SIZE;
+    void* mem = mmap(nullptr, bytes, PROT_NONE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) {
+        return false;
+    }
+
+    Registry& registry = _registry();
+    pthread_mutex_lock(&registry.m_lock);
+    bool registered = false;
+    for (int i = 0; i < GUARDED_MAX_POOLS && !registered; i++) {
+        GuardedPool* expected = nullptr;
+        registered = registry.m_pools[i].compare_exchange_strong(expected, this);
+    }
+    if (registered && !registry.m_installed) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = _on_fault;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&action.sa_mask);
+        registry.m_installed = sigaction(SIGSEGV, &action, &registry.m_previous) == 0;
+        registered = registry.m_installed;
+    }
+    pthread_mutex_unlock(&registry.m_lock);
+    if (!registered) {
+        munmap(mem, bytes);
+        return false;
+    }
+
+    _start.store(reinterpret_cast<uintptr_t>(mem), std::memory_order_relaxed);
+    _end.store(reinterpret_cast<uintptr_t>(mem) + bytes, std::memory_order_relaxed);
+    return true;
+}
+
+inline bool GuardedPool::_set_rate(size_t calls) {
+    pthread_mutex_lock(&_lock);
+    bool ok = !calls || _start.load(std::memory_order_relaxed) || _map_pool();
+    if (ok) {
+        _rate.store(calls, std::memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&_lock);
+    return ok;
+}
+
+inline size_t GuardedPool::_get_rate() const {
+    return _rate.load(std::memory_order_relaxed);
+}
+
+// Uniform in [1, 2 * rate - 1], so one call in `rate` is sampled on average
+inline size_t GuardedPool::_next_countdown(GuardedThreadState& state) const {
+    size_t rate = _rate.load(std::memory_order_relaxed);
+    if (!rate) {
+        return GUARDED_RECHECK_CALLS;
+    }
+    if (!state.m_rng) {
+        state.m_rng = reinterpret_cast<uint64_t>(&state) ^ (uint64_t)time(nullptr) ^ 0x9E3779B97F4A7C15ull;
+    }
+    state.m_rng ^= state.m_rng >> 12;
+    state.m_rng ^= state.m_rng << 25;
+    state.m_rng ^= state.m_rng >> 27;
+    uint64_t r = state.m_rng * 0x2545F4914F6CDD1Dull;
+    return 1 + (size_t)(r % (2 * rate - 1));
+}
+
+__attribute__((noinline)) inline void* GuardedPool::_allocate(size_t size) {
+    if (size == 0 || size > GUARDED_PAGE_SIZE) {
+        return nullptr;
+    }
+    pthread_mutex_lock(&_lock);
+    if (!_start.load(std::memory_order_relaxed)) {
+        pthread_mutex_unlock(&_lock);
+        return nullptr;
+    }
+    size_t slot = GUARDED_SLOTS;
+    for (size_t i = 0; i < GUARDED_SLOTS; i++) {
+        size_t candidate = (_next_slot + i) % GUARDED_SLOTS;
+        if (!_slots[candidate].m_live) {
+            slot = candidate;
+            break;
+        }
+    }
+    if (slot == GUARDED_SLOTS ||
+        mprotect(reinterpret_cast<void*>(_page(slot)), GUARDED_PAGE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        pthread_mutex_unlock(&_lock);
+        return nullptr;
+    }
+    _next_slot = (slot + 1) % GUARDED_SLOTS;
+
+    GuardedSlot& s = _slots[slot];
+    size_t offset = GUARDED_PAGE_SIZE - ((size + GUARDED_ALIGNMENT - 1) & ~(size_t)(GUARDED_ALIGNMENT - 1));
+    s.m_ptr = _page(slot) + offset;
+    s.m_size = size;
+    s.m_live = true;
+    _capture(s.m_alloc);
+    pthread_mutex_unlock(&_lock);
+    return reinterpret_cast<void*>(s.m_ptr);
+}
+
+__attribute__((noinline)) inline void GuardedPool::_deallocate(void* p) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+    pthread_mutex_lock(&_lock);
+    GuardedSlot* slot = _slot_of(addr);
+    if (!slot || !slot->m_live || slot->m_ptr != addr) {
+        const char* kind = slot && slot->m_ptr == addr ? "double free" : "invalid free";
+        _print("smalloc guard: %s of %p\n", kind, p);
+        if (slot && slot->m_ptr) {
+            _print_stack("allocated", slot->m_alloc);
+            if (!slot->m_live) {
+                _print_stack("freed", slot->m_free);
+            }
+        }
+        abort();
+    }
+    uintptr_t page = addr & ~(uintptr_t)(GUARDED_PAGE_SIZE - 1);
+    // Gives the memory back as well; the page reads as zeros once reused
+    madvise(reinterpret_cast<void*>(page), GUARDED_PAGE_SIZE, MADV_DONTNEED);
+    mprotect(reinterpret_cast<void*>(page), GUARDED_PAGE_SIZE, PROT_NONE);
+    slot->m_live = false;
+    _capture(slot->m_free);
+    pthread_mutex_unlock(&_lock);
+}
+
+inline size_t GuardedPool::_size(const void* p) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+    pthread_mutex_lock(&_lock);
+    GuardedSlot* slot = _slot_of(addr);
+    size_t size = slot && slot->m_live && slot->m_ptr == addr ? slot->m_size : 0;
+    pthread_mutex_unlock(&_lock);
+    return size;
+}
+
+inline void GuardedPool::_prefork() {
+    pthread_mutex_lock(&_lock);
+}
+
+inline void GuardedPool::_postfork_parent() {
+    pthread_mutex_unlock(&_lock);
+}
+
+inline void GuardedPool::_postfork_child() {
+    pthread_mutex_init(&_lock, nullptr);
+}
+
+#endif // GUARDED_POOL_H
@@ -0,0 +1,20 @@
+#ifndef HEAP_GEOMETRY_H
+#define HEAP_GEOMETRY_H
+
+// Geometry of the buddy heap (malloc_3, malloc_4), shared with code that
+// sizes its requests to whole buddy blocks (object_pool.h). Code built
+// against a variant compiled with other values must define the same macros.
+#ifndef SMALLOC_MIN_BLOCK
+#define SMALLOC_MIN_BLOCK 128 // Order 0 block, header included
+#endif
+#ifndef SMALLOC_MAX_ORDER
+#define SMALLOC_MAX_ORDER 10  // 128 << 10 = 128 KB; larger requests are mmapped
+#endif
+#ifndef SMALLOC_NUM_BLOCKS
+#define SMALLOC_NUM_BLOCKS 32 // Max-order blocks in the base pool (4 MB)
+#endif
+#ifndef SMALLOC_POOL_RESERVE
+#define SMALLOC_POOL_RESERVE 64 // Address space reserved for the pool, in base pools (256 MB)
+#endif
+
+#endif // HEAP_GEOMETRY_H
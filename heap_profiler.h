@@ -0,0 +1,248 @@
+#ifndef HEAP_PROFILER_H
+#define HEAP_PROFILER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <cmath>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <stdio.h>
+#include <time.h>
+
+#define PROFILER_MAX_SAMPLES 4096 // Live sampled objects tracked at once (power of two)
+#define PROFILER_MAX_DEPTH 32     // Frames kept per allocation site
+#define PROFILER_SKIP_FRAMES 2    // _record() and the allocator's sampling hook
+
+// One sampled allocation that has not been freed yet
+struct HeapSample {
+    void* m_ptr; // nullptr marks an empty slot
+    size_t m_size;
+    int m_depth;
+    void* m_stack[PROFILER_MAX_DEPTH];
+};
+
+// Per-thread sampling state. Every allocator keeps its own thread_local copy
+// so variants linked into the same binary sample independently.
+struct SamplerState {
+    size_t m_bytes_until_sample;
+    uint64_t m_rng; // 0 until the thread takes its first sampling decision
+};
+
+// Sampling heap profiler: roughly one allocation is recorded for every
+// `_sample_rate` bytes handed out, with the gap between samples drawn from an
+// exponential distribution so that every byte has the same chance to be picked.
+// Records live in a fixed open-addressing table keyed by pointer (no dynamic
+// allocation, so the profiler never recurses into the allocator it watches).
+class HeapProfiler {
+private:
+    std::atomic<size_t> _sample_rate; // Mean bytes between samples, 0 disables
+    size_t _live_samples;
+    size_t _dropped_samples; // Samples lost because the table was full
+    HeapSample _samples[PROFILER_MAX_SAMPLES];
+    pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+
+    static size_t _slot(void* p);
+    size_t _next_sample_gap(SamplerState& state) const;
+
+public:
+    HeapProfiler() : _sample_rate(0), _live_samples(0), _dropped_samples(0) {}
+
+    // The only check on the allocation fast path
+    bool _enabled() const {
+        return _sample_rate.load(std::memory_order_relaxed) != 0;
+    }
+
+    void _set_sample_rate(size_t bytes);
+    size_t _get_sample_rate() const;
+    bool _should_sample(SamplerState& state, size_t size);
+    bool _record(void* p, size_t size);
+    void _remove(void* p);
+    size_t _get_dropped_samples() const;
+    bool _dump(const char* path);
+
+    void _prefork();
+    void _postfork_parent();
+    void _postfork_child();
+};
+
+inline size_t HeapProfiler::_slot(void* p) {
+    // Fibonacci hashing; the low bits of a block address are always zero
+    uint64_t h = (reinterpret_cast<uint64_t>(p) >> 4) * 0x9E3779B97F4A7C15ull;
+    return (size_t)(h >> 32) & (PROFILER_MAX_SAMPLES - 1);
+}
+
+inline size_t HeapProfiler::_next_sample_gap(SamplerState& state) const {
+    // xorshift64*, then map 53 random bits to a uniform value in (0, 1]
+    state.m_rng ^= state.m_rng >> 12;
+    state.m_rng ^= state.m_rng << 25;
+    state.m_rng ^= state.m_rng >> 27;
+    uint64_t r = state.m_rng * 0x2545F4914F6CDD1Dull;
+    double u = ((r >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double gap = -std::log(u) * (double)_sample_rate.load(std::memory_order_relaxed);
+    return gap < 1.0 ? 1 : (size_t)gap;
+}
+
+inline void HeapProfiler::_set_sample_rate(size_t bytes) {
+    _sample_rate.store(bytes, std::memory_order_relaxed);
+}
+
+inline size_t HeapProfiler::_get_sample_rate() const {
+    return _sample_rate.load(std::memory_order_relaxed);
+}
+
+inline size_t HeapProfiler::_get_dropped_samples() const {
+    return _dropped_samples;
+}
+
+inline bool HeapProfiler::_should_sample(SamplerState& state, size_t size) {
+    if (state.m_bytes_until_sample > size) {
+        state.m_bytes_until_sample -= size;
+        return false;
+    }
+    // A fresh thread only draws its first gap, otherwise every thread's
+    // first allocation would be sampled
+    bool first_time = state.m_rng == 0;
+    if (first_time) {
+        state.m_rng = reinterpret_cast<uint64_t>(&state) ^ (uint64_t)time(nullptr) ^ 0x9E3779B97F4A7C15ull;
+    }
+    state.m_bytes_until_sample = _next_sample_gap(state);
+    return !first_time;
+}
+
+// Never inlined so the number of frames to skip is stable
+__attribute__((noinline)) inline bool HeapProfiler::_record(void* p, size_t size) {
+    void* stack[PROFILER_MAX_DEPTH + PROFILER_SKIP_FRAMES];
+    int depth = backtrace(stack, PROFILER_MAX_DEPTH + PROFILER_SKIP_FRAMES) - PROFILER_SKIP_FRAMES;
+    if (depth < 0) {
+        depth = 0;
+    }
+
+    pthread_mutex_lock(&_lock);
+    // Keep the table at most 3/4 full so probe sequences stay short
+    if (_live_samples >= PROFILER_MAX_SAMPLES / 4 * 3) {
+        _dropped_samples++;
+        pthread_mutex_unlock(&_lock);
+        return false;
+    }
+    size_t i = _slot(p);
+    while (_samples[i].m_ptr) {
+        i = (i + 1) & (PROFILER_MAX_SAMPLES - 1);
+    }
+    HeapSample& s = _samples[i];
+    s.m_ptr = p;
+    s.m_size = size;
+    s.m_depth = depth;
+    memcpy(s.m_stack, stack + PROFILER_SKIP_FRAMES, depth * sizeof(void*));
+    _live_samples++;
+    pthread_mutex_unlock(&_lock);
+    return true;
+}
+
+inline void HeapProfiler::_remove(void* p) {
+    pthread_mutex_lock(&_lock);
+    size_t i = _slot(p);
+    while (_samples[i].m_ptr && _samples[i].m_ptr != p) {
+        i = (i + 1) & (PROFILER_MAX_SAMPLES - 1);
+    }
+    if (!_samples[i].m_ptr) {
+        pthread_mutex_unlock(&_lock);
+        return;
+    }
+    // Backward-shift deletion: pull later entries of the probe chain into the
+    // hole so lookups never need tombstones
+    size_t hole = i;
+    size_t j = i;
+    while (true) {
+        j = (j + 1) & (PROFILER_MAX_SAMPLES - 1);
+        if (!_samples[j].m_ptr) {
+            break;
+        }
+        size_t home = _slot(_samples[j].m_ptr);
+        bool movable = (hole <= j) ? (home <= hole || home > j) : (home <= hole && home > j);
+        if (movable) {
+            _samples[hole] = _samples[j];
+            hole = j;
+        }
+    }
+    _samples[hole].m_ptr = nullptr;
+    _live_samples--;
+    pthread_mutex_unlock(&_lock);
+}
+
+// Writes the live sampled heap in the legacy text format understood by
+// `pprof --text <binary> <file>`; pprof un-samples using the rate in the header.
+inline bool HeapProfiler::_dump(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&_lock);
+    size_t total_objs = 0, total_bytes = 0;
+    for (int i = 0; i < PROFILER_MAX_SAMPLES; i++) {
+        if (_samples[i].m_ptr) {
+            total_objs++;
+            total_bytes += _samples[i].m_size;
+        }
+    }
+    dprintf(fd, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+            total_objs, total_bytes, total_objs, total_bytes, _get_sample_rate());
+
+    // Aggregate samples that share a call stack into one line
+    bool reported[PROFILER_MAX_SAMPLES] = {};
+    for (int i = 0; i < PROFILER_MAX_SAMPLES; i++) {
+        const HeapSample& s = _samples[i];
+        if (!s.m_ptr || reported[i]) {
+            continue;
+        }
+        size_t objs = 0, bytes = 0;
+        for (int j = i; j < PROFILER_MAX_SAMPLES; j++) {
+            const HeapSample& o = _samples[j];
+            if (o.m_ptr && !reported[j] && o.m_depth == s.m_depth &&
+                memcmp(o.m_stack, s.m_stack, s.m_depth * sizeof(void*)) == 0) {
+                reported[j] = true;
+                objs++;
+                bytes += o.m_size;
+            }
+        }
+        dprintf(fd, "%zu: %zu [%zu: %zu] @", objs, bytes, objs, bytes);
+        for (int k = 0; k < s.m_depth; k++) {
+            dprintf(fd, " %p", s.m_stack[k]);
+        }
+        dprintf(fd, "\n");
+    }
+    pthread_mutex_unlock(&_lock);
+
+    // pprof needs the mappings to symbolize addresses
+    dprintf(fd, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0) {
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(maps, buf, sizeof(buf))) > 0) {
+            if (write(fd, buf, n) != n) {
+                break;
+            }
+        }
+        close(maps);
+    }
+    close(fd);
+    return true;
+}
+
+inline void HeapProfiler::_prefork() {
+    pthread_mutex_lock(&_lock);
+}
+
+inline void HeapProfiler::_postfork_parent() {
+    pthread_mutex_unlock(&_lock);
+}
+
+inline void HeapProfiler::_postfork_child() {
+    pthread_mutex_init(&_lock, nullptr);
+}
+
+#endif // HEAP_PROFILER_H
@@ -0,0 +1,163 @@
+#ifndef HEAP_STATS_H
+#define HEAP_STATS_H
+
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#define STATS_MAX_ORDERS 32
+
+// Public entry points counted by the heap. STAT_NONE is used for calls the
+// allocator makes to itself (e.g. srealloc falling back to a new block).
+enum StatCall {
+    STAT_SMALLOC,
+    STAT_SCALLOC,
+    STAT_SREALLOC,
+    STAT_SFREE,
+    STAT_CALL_KINDS,
+    STAT_NONE = STAT_CALL_KINDS
+};
+
+// Buddy blocks of one order. Byte counts include the block's metadata.
+struct OrderStats {
+    size_t m_block_size;
+    size_t m_free_blocks;
+    size_t m_free_bytes;
+    size_t m_allocated_blocks;
+    size_t m_allocated_bytes;
+    size_t m_requested_bytes; // What callers asked for in the allocated blocks
+};
+
+// Point-in-time view of a heap, taken under the heap lock
+struct HeapStats {
+    int m_num_orders;
+    OrderStats m_orders[STATS_MAX_ORDERS];
+
+    size_t m_free_bytes;         // Free buddy bytes, all orders
+    size_t m_largest_free_block; // Largest free buddy block
+    double m_external_fragmentation; // 1 - largest free block / free bytes
+
+    size_t m_allocated_bytes;    // Allocated buddy bytes, all orders
+    size_t m_requested_bytes;
+    double m_internal_fragmentation; // 1 - requested / allocated buddy bytes
+
+    size_t m_mmap_blocks;
+    size_t m_mmap_bytes;
+    size_t m_hugepage_blocks;
+    size_t m_hugepage_bytes;
+
+    size_t m_calls[STAT_CALL_KINDS];
+    size_t m_splits;
+    size_t m_merges;
+    size_t m_mmap_calls;
+    size_t m_munmap_calls;
+
+    size_t m_mmap_threshold;        // Largest block (header included) not mapped at its exact size
+    size_t m_mmap_threshold_raises; // Times the adaptive threshold went up
+    size_t m_cached_blocks;         // Freed superblocks kept for reuse instead of unmapped
+    size_t m_cached_bytes;
+    size_t m_cache_hits;            // Large allocations served from the cache
+};
+
+// Derives the totals and ratios from the per-order numbers
+inline void heap_stats_finish(HeapStats& stats) {
+    stats.m_free_bytes = 0;
+    stats.m_largest_free_block = 0;
+    stats.m_allocated_bytes = 0;
+    stats.m_requested_bytes = 0;
+    for (int i = 0; i < stats.m_num_orders; i++) {
+        const OrderStats& o = stats.m_orders[i];
+        stats.m_free_bytes += o.m_free_bytes;
+        stats.m_allocated_bytes += o.m_allocated_bytes;
+        stats.m_requested_bytes += o.m_requested_bytes;
+        if (o.m_free_blocks) {
+            stats.m_largest_free_block = o.m_block_size;
+        }
+    }
+    stats.m_external_fragmentation = stats.m_free_bytes ?
+            1.0 - (double)stats.m_largest_free_block / stats.m_free_bytes : 0.0;
+    stats.m_internal_fragmentation = stats.m_allocated_bytes ?
+            1.0 - (double)stats.m_requested_bytes / stats.m_allocated_bytes : 0.0;
+}
+
+// Adds the counts of another heap with the same orders into `total`, for a
+// view over several arenas; the threshold is the largest one. The totals and
+// ratios are derived again.
+inline void heap_stats_merge(HeapStats& total, const HeapStats& stats) {
+    total.m_num_orders = stats.m_num_orders;
+    for (int i = 0; i < stats.m_num_orders; i++) {
+        OrderStats& t = total.m_orders[i];
+        const OrderStats& o = stats.m_orders[i];
+        t.m_block_size = o.m_block_size;
+        t.m_free_blocks += o.m_free_blocks;
+        t.m_free_bytes += o.m_free_bytes;
+        t.m_allocated_blocks += o.m_allocated_blocks;
+        t.m_allocated_bytes += o.m_allocated_bytes;
+        t.m_requested_bytes += o.m_requested_bytes;
+    }
+    heap_stats_finish(total);
+
+    total.m_mmap_blocks += stats.m_mmap_blocks;
+    total.m_mmap_bytes += stats.m_mmap_bytes;
+    total.m_hugepage_blocks += stats.m_hugepage_blocks;
+    total.m_hugepage_bytes += stats.m_hugepage_bytes;
+    for (int i = 0; i < STAT_CALL_KINDS; i++) {
+        total.m_calls[i] += stats.m_calls[i];
+    }
+    total.m_splits += stats.m_splits;
+    total.m_merges += stats.m_merges;
+    total.m_mmap_calls += stats.m_mmap_calls;
+    total.m_munmap_calls += stats.m_munmap_calls;
+    if (stats.m_mmap_threshold > total.m_mmap_threshold) {
+        total.m_mmap_threshold = stats.m_mmap_threshold;
+    }
+    total.m_mmap_threshold_raises += stats.m_mmap_threshold_raises;
+    total.m_cached_blocks += stats.m_cached_blocks;
+    total.m_cached_bytes += stats.m_cached_bytes;
+    total.m_cache_hits += stats.m_cache_hits;
+}
+
+inline void heap_stats_write_json(const HeapStats& stats, int fd) {
+    static const char* call_names[STAT_CALL_KINDS] = {"smalloc", "scalloc", "srealloc", "sfree"};
+
+    dprintf(fd, "{\n  \"orders\": [\n");
+    for (int i = 0; i < stats.m_num_orders; i++) {
+        const OrderStats& o = stats.m_orders[i];
+        dprintf(fd, "    {\"order\": %d, \"block_size\": %zu, \"free_blocks\": %zu, \"free_bytes\": %zu, "
+                    "\"allocated_blocks\": %zu, \"allocated_bytes\": %zu, \"requested_bytes\": %zu}%s\n",
+                i, o.m_block_size, o.m_free_blocks, o.m_free_bytes, o.m_allocated_blocks,
+                o.m_allocated_bytes, o.m_requested_bytes, i + 1 < stats.m_num_orders ? "," : "");
+    }
+    dprintf(fd, "  ],\n");
+    dprintf(fd, "  \"free_bytes\": %zu,\n  \"largest_free_block\": %zu,\n  \"external_fragmentation\": %.6f,\n",
+            stats.m_free_bytes, stats.m_largest_free_block, stats.m_external_fragmentation);
+    dprintf(fd, "  \"allocated_bytes\": %zu,\n  \"requested_bytes\": %zu,\n  \"internal_fragmentation\": %.6f,\n",
+            stats.m_allocated_bytes, stats.m_requested_bytes, stats.m_internal_fragmentation);
+    dprintf(fd, "  \"mmap_blocks\": %zu,\n  \"mmap_bytes\": %zu,\n  \"hugepage_blocks\": %zu,\n  \"hugepage_bytes\": %zu,\n",
+            stats.m_mmap_blocks, stats.m_mmap_bytes, stats.m_hugepage_blocks, stats.m_hugepage_bytes);
+    dprintf(fd, "  \"calls\": {");
+    for (int i = 0; i < STAT_CALL_KINDS; i++) {
+        dprintf(fd, "\"%s\": %zu%s", call_names[i], stats.m_calls[i], i + 1 < STAT_CALL_KINDS ? ", " : "");
+    }
+    dprintf(fd, "},\n");
+    dprintf(fd, "  \"splits\": %zu,\n  \"merges\": %zu,\n  \"mmap_calls\": %zu,\n  \"munmap_calls\": %zu,\n",
+            stats.m_splits, stats.m_merges, stats.m_mmap_calls, stats.m_munmap_calls);
+    dprintf(fd, "  \"mmap_threshold\": %zu,\n  \"mmap_threshold_raises\": %zu,\n  \"cached_blocks\": %zu,\n"
+                "  \"cached_bytes\": %zu,\n  \"cache_hits\": %zu\n}\n",
+            stats.m_mmap_threshold, stats.m_mmap_threshold_raises, stats.m_cached_blocks,
+            stats.m_cached_bytes, stats.m_cache_hits);
+}
+
+inline bool heap_stats_dump_json(const HeapStats& stats, const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    heap_stats_write_json(stats, fd);
+    close(fd);
+    return true;
+}
+
+#endif // HEAP_STATS_H
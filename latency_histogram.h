@@ -0,0 +1,242 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+// Cycle-count instrumentation of the allocator, compiled in only with
+// -DSMALLOC_INSTRUMENT. Without it LATENCY_SCOPE expands to nothing, so the
+// instrumented code is identical to the plain build.
+
+#ifdef SMALLOC_INSTRUMENT
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define LATENCY_BUCKETS 64 // Bucket i counts durations in [2^i, 2^(i+1)) cycles
+
+enum LatencyProbe {
+    PROBE_SMALLOC,
+    PROBE_SCALLOC,
+    PROBE_SREALLOC,
+    PROBE_SFREE,
+    PROBE_DIV_BUDDIES,
+    PROBE_MERGE_BUDDIES,
+    PROBE_COMMIT,
+    PROBE_MMAP,
+    PROBE_MUNMAP,
+    PROBE_KINDS
+};
+
+// One thread's histograms. Only the owning thread writes, so updates are a
+// plain load/store; readers merging on demand may see a slightly stale view.
+struct ThreadHistograms {
+    std::atomic<uint64_t> m_counts[PROBE_KINDS][LATENCY_BUCKETS];
+    std::atomic<uint64_t> m_cycles[PROBE_KINDS];
+    std::atomic<bool> m_in_use;
+    ThreadHistograms* m_next;
+};
+
+struct LatencySnapshot {
+    uint64_t m_counts[PROBE_KINDS][LATENCY_BUCKETS];
+    uint64_t m_cycles[PROBE_KINDS];
+};
+
+inline uint64_t latency_now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+// Histograms are mapped once per thread and kept on a lock-free list. A thread
+// that exits hands its histograms to the next new thread, so nothing recorded
+// is lost and thread churn does not grow the list.
+class LatencyRecorder {
+private:
+    std::atomic<ThreadHistograms*> _threads;
+
+public:
+    LatencyRecorder() : _threads(nullptr) {}
+
+    ThreadHistograms* _claim();
+    void _release(ThreadHistograms* h);
+    void _merge(LatencySnapshot& out) const;
+    void _reset();
+    bool _dump(const char* path) const;
+};
+
+// Per-thread handle; each allocator keeps its own thread_local one
+struct LatencyThreadState {
+    LatencyRecorder* m_recorder;
+    ThreadHistograms* m_histograms;
+    ~LatencyThreadState() {
+        if (m_recorder) {
+            m_recorder->_release(m_histograms);
+        }
+    }
+};
+
+inline ThreadHistograms* LatencyRecorder::_claim() {
+    for (ThreadHistograms* h = _threads.load(std::memory_order_acquire); h; h = h->m_next) {
+        bool expected = false;
+        if (!h->m_in_use.load(std::memory_order_relaxed) &&
+            h->m_in_use.compare_exchange_strong(expected, true)) {
+            return h;
+        }
+    }
+    void* mem = mmap(nullptr, sizeof(ThreadHistograms), PROT_READ | PROT_WRITE,
+                     MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) {
+        return nullptr;
+    }
+    ThreadHistograms* h = static_cast<ThreadHistograms*>(mem); // mmap memory is zeroed
+    h->m_in_use.store(true, std::memory_order_relaxed);
+    ThreadHistograms* head = _threads.load(std::memory_order_relaxed);
+    do {
+        h->m_next = head;
+    } while (!_threads.compare_exchange_weak(head, h, std::memory_order_release,
+                                             std::memory_order_relaxed));
+    return h;
+}
+
+inline void LatencyRecorder::_release(ThreadHistograms* h) {
+    if (h) {
+        h->m_in_use.store(false, std::memory_order_release);
+    }
+}
+
+inline void LatencyRecorder::_merge(LatencySnapshot& out) const {
+    memset(&out, 0, sizeof(out));
+    for (ThreadHistograms* h = _threads.load(std::memory_order_acquire); h; h = h->m_next) {
+        for (int p = 0; p < PROBE_KINDS; p++) {
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                out.m_counts[p][b] += h->m_counts[p][b].load(std::memory_order_relaxed);
+            }
+            out.m_cycles[p] += h->m_cycles[p].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// Racy with threads that are recording at the same time; meant for use
+// between measurement phases
+inline void LatencyRecorder::_reset() {
+    for (ThreadHistograms* h = _threads.load(std::memory_order_acquire); h; h = h->m_next) {
+        for (int p = 0; p < PROBE_KINDS; p++) {
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                h->m_counts[p][b].store(0, std::memory_order_relaxed);
+            }
+            h->m_cycles[p].store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+// Upper bound (in cycles) of the bucket holding the given percentile
+inline uint64_t latency_percentile(const uint64_t* counts, uint64_t total, double pct) {
+    uint64_t rank = (uint64_t)(total * pct);
+    uint64_t seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen > rank) {
+            return b >= 63 ? UINT64_MAX : (2ull << b) - 1;
+        }
+    }
+    return 0;
+}
+
+inline bool LatencyRecorder::_dump(const char* path) const {
+    static const char* names[PROBE_KINDS] = {
+            "smalloc", "scalloc", "srealloc", "sfree", "div_buddies",
+            "merge_buddies", "commit", "mmap", "munmap"};
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    LatencySnapshot snap;
+    _merge(snap);
+
+    dprintf(fd, "%-14s %12s %12s %10s %10s %10s\n", "probe", "count", "mean_cycles", "p50<=", "p90<=", "p99<=");
+    for (int p = 0; p < PROBE_KINDS; p++) {
+        uint64_t total = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            total += snap.m_counts[p][b];
+        }
+        if (!total) {
+            continue;
+        }
+        dprintf(fd, "%-14s %12llu %12.1f %10llu %10llu %10llu\n", names[p],
+                (unsigned long long)total, (double)snap.m_cycles[p] / total,
+                (unsigned long long)latency_percentile(snap.m_counts[p], total, 0.50),
+                (unsigned long long)latency_percentile(snap.m_counts[p], total, 0.90),
+                (unsigned long long)latency_percentile(snap.m_counts[p], total, 0.99));
+    }
+
+    dprintf(fd, "\n# histograms: probe bucket_low_cycles count\n");
+    for (int p = 0; p < PROBE_KINDS; p++) {
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            if (snap.m_counts[p][b]) {
+                dprintf(fd, "%s %llu %llu\n", names[p], b ? 1ull << b : 0ull,
+                        (unsigned long long)snap.m_counts[p][b]);
+            }
+        }
+    }
+    close(fd);
+    return true;
+}
+
+// Times its own scope and adds the duration to the calling thread's histogram
+class LatencyScope {
+private:
+    LatencyThreadState& _state;
+    LatencyProbe _probe;
+    uint64_t _start;
+
+public:
+    LatencyScope(LatencyRecorder& recorder, LatencyThreadState& state, LatencyProbe probe)
+            : _state(state), _probe(probe) {
+        if (!_state.m_recorder) {
+            _state.m_recorder = &recorder;
+            _state.m_histograms = recorder._claim();
+        }
+        _start = latency_now();
+    }
+
+    ~LatencyScope() {
+        uint64_t cycles = latency_now() - _start;
+        ThreadHistograms* h = _state.m_histograms;
+        if (!h) {
+            return;
+        }
+        int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+        std::atomic<uint64_t>& count = h->m_counts[_probe][bucket];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic<uint64_t>& sum = h->m_cycles[_probe];
+        sum.store(sum.load(std::memory_order_relaxed) + cycles, std::memory_order_relaxed);
+    }
+
+    LatencyScope(const LatencyScope&) = delete;
+    LatencyScope& operator=(const LatencyScope&) = delete;
+};
+
+#define LATENCY_CONCAT_(a, b) a##b
+#define LATENCY_CONCAT(a, b) LATENCY_CONCAT_(a, b)
+#define LATENCY_SCOPE(recorder, state, probe) \
+    LatencyScope LATENCY_CONCAT(_latency_scope_, __LINE__)((recorder), (state), (probe))
+
+#else
+
+#define LATENCY_SCOPE(recorder, state, probe)
+
+#endif // SMALLOC_INSTRUMENT
+
+#endif // LATENCY_HISTOGRAM_H
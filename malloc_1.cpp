@@ -1,5 +1,9 @@
 #include <unistd.h>
+#include "smalloc.h"
 #define MAX_MEM 100000000
+
+SMALLOC_BEGIN_NAMESPACE
+
 void* smalloc(size_t size){
     if(size <= 0 || size > MAX_MEM){
         return nullptr;
@@ -11,4 +15,6 @@ void* smalloc(size_t size){
         return nullptr;
     }
     return ptr;
-}
\ No newline at end of file
+}
+
+SMALLOC_END_NAMESPACE
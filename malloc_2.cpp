@@ -1,8 +1,11 @@
 #include <unistd.h>
 #include <string.h>
+#include "smalloc.h"
 
 #define MAX_MEM 100000000
 
+SMALLOC_BEGIN_NAMESPACE
+
 struct MallocMetadata {
     size_t m_size; // Only the block size for the user "Withoud metadata"
     bool m_is_free;
@@ -188,6 +191,19 @@ void* srealloc(void* oldp, size_t size) {
     return ptr;
 }
 
+size_t smalloc_usable_size(void* p) {
+    return p ? heap._get_block_size(p) : 0;
+}
+
+// A reused free block can be larger than `size`
+void* smalloc_at_least(size_t size, size_t* actual) {
+    void* p = smalloc(size);
+    if (actual) {
+        *actual = smalloc_usable_size(p);
+    }
+    return p;
+}
+
 size_t _num_free_blocks() {
     return heap._get_free_blocks_num();
 }
@@ -211,3 +227,5 @@ size_t _num_meta_data_bytes() {
 size_t _size_meta_data() {
     return heap._get_Metadata_size();
 }
+
+SMALLOC_END_NAMESPACE
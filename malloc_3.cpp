@@ -1,20 +1,81 @@
 #include <unistd.h>
+#include <stdint.h>
 #include <string.h>
-#include <cmath>
+#include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <assert.h>
+#include <atomic>
 #include <iostream>
+#include <new>
+#include "guarded_pool.h"
+#include "heap_geometry.h"
+#include "heap_profiler.h"
+#include "alloc_trace.h"
+#include "heap_stats.h"
+#include "latency_histogram.h"
+#include "page_map.h"
+#include "reserved_range.h"
+#include "smalloc.h"
 
 
 #define MAX_MEM 100000000
-#define MAX_ORDER 10
-#define MAX_BLOCK_SIZE (128 * 1024)
-#define NUM_BLOCKS 32
 
-// Metadata structure for each memory block
-struct MallocMetadata {
+// Configuration of the process heap (geometry in heap_geometry.h); see Heap
+// for the constraints
+#ifndef SMALLOC_MMAP_THRESHOLD_MAX
+#define SMALLOC_MMAP_THRESHOLD_MAX (32 * 1024 * 1024) // Bound of the adaptive mmap threshold
+#endif
+#define MMAP_CACHE_FACTOR 2 // Cached superblocks may hold this many thresholds of bytes
+#define BUDGET_SYNC_BYTES (64 * 1024) // Per-thread budget drift before it is folded into the total
+#define MMAP_PAGE_SIZE 4096 // Other mmapped blocks are rounded to whole pages
+
+// Lazy coalescing: freed blocks stay at their order and are merged only when
+// an allocation finds nothing large enough or too many of them pile up
+#ifndef SMALLOC_LAZY_COALESCE
+#define SMALLOC_LAZY_COALESCE 0
+#endif
+#ifndef SMALLOC_LAZY_WATERMARK
+#define SMALLOC_LAZY_WATERMARK 32 // Uncoalesced frees at one order before a merge pass
+#endif
+
+// Prefetching when a free block is popped: 1 prefetches the free-list node
+// the next pop of that order will write, 2 also the second cache line of
+// the block handed out (the first one holds the header and is already hot)
+#ifndef SMALLOC_PREFETCH
+#define SMALLOC_PREFETCH 1
+#endif
+
+// NUMA arenas: one heap per memory node, up to this many
+#ifndef SMALLOC_MAX_ARENAS
+#define SMALLOC_MAX_ARENAS 4
+#endif
+#define ARENA_NODE_REFRESH 256 // Allocations between getcpu() calls of a thread
+#define ARENA_MAX_NODE 1023    // Highest node id an arena can be bound to
+
+SMALLOC_BEGIN_NAMESPACE
+
+#ifdef SMALLOC_INSTRUMENT
+LatencyRecorder latency;
+static thread_local LatencyThreadState latency_state;
+#endif
+// Expands to nothing unless built with -DSMALLOC_INSTRUMENT
+#define HEAP_LATENCY(probe) LATENCY_SCOPE(latency, latency_state, probe)
+
+// Metadata structure for each memory block. Blocks start at least 16-byte
+// aligned, and the header is padded to a multiple of 16 so the user pointer
+// right after it is too (alignof(max_align_t), what operator new promises).
+struct alignas(16) MallocMetadata {
     size_t m_data_size; //Only the user data
     size_t m_size; //The size of the block with the meta data
     bool m_is_free;
+    bool m_is_sampled; //Tracked by the heap profiler until it is freed
+    uint32_t m_requested_size; //What the user asked for (fits in the padding, sizes are capped by MAX_MEM)
     MallocMetadata* m_next;
     MallocMetadata* m_prev;
 };
@@ -25,11 +86,29 @@ struct list{
     MallocMetadata* m_tail;
     size_t m_size;
     void insert(MallocMetadata* m);
+    void push(MallocMetadata* m);
     void remove(MallocMetadata* m);
 };
 
+// Adds a block at the head in O(1), for lists that are never searched (the
+// allocated blocks); the free lists stay sorted for buddy merging
+void list::push(MallocMetadata* m) {
+    m->m_prev = nullptr;
+    m->m_next = m_head;
+    if (m_head) {
+        m_head->m_prev = m;
+    } else {
+        m_tail = m;
+    }
+    m_head = m;
+    m_size++;
+}
+
 // Inserting a block into the list (ordered by memory address)
 void list::insert(MallocMetadata* m) {
+    // The block comes from another list or a split, so its links are stale
+    m->m_next = nullptr;
+    m->m_prev = nullptr;
     if (m_size == 0) {
         m_head = m;
         m_tail = m;
@@ -89,7 +168,95 @@ void list::remove(MallocMetadata *m) {
 
 }
 
+// What a page of the heap belongs to: the buddy pool, or one mmapped block.
+// The page map points every page of a span at its descriptor.
+enum SpanKind {
+    SPAN_BUDDY,
+    SPAN_MMAP,
+};
+
+struct Span {
+    uintptr_t m_start;
+    size_t m_bytes;
+    SpanKind m_kind;
+};
+
+// Memory budget of the whole process (smalloc_budget_set), shared by the
+// NUMA arenas. Heaps charge their usage to a per-thread delta, which is
+// folded into m_used only once it drifts BUDGET_SYNC_BYTES either way (or the
+// thread exits), so the shared line is not written on every call. A thread
+// checks the limits against m_used plus its own delta; the others' unfolded
+// deltas can take the process past the hard limit by up to
+// BUDGET_SYNC_BYTES each.
+struct HeapBudget {
+    std::atomic<ptrdiff_t> m_used; // Frees folded before their allocations may take it below 0
+    std::atomic<size_t> m_soft;    // 0 means no limit
+    std::atomic<size_t> m_hard;
+    std::atomic<bool> m_over_soft;
+};
+
+static HeapBudget process_budget;
+
+struct BudgetThreadState {
+    ptrdiff_t m_delta;
+    bool m_exited; // Charges from later thread-exit code are folded at once
+    ~BudgetThreadState() {
+        process_budget.m_used.fetch_add(m_delta, std::memory_order_relaxed);
+        m_delta = 0;
+        m_exited = true;
+    }
+};
+static thread_local BudgetThreadState budget_state;
+
+static inline void _budget_add(ptrdiff_t bytes) {
+    BudgetThreadState& state = budget_state;
+    state.m_delta += bytes;
+    if (state.m_delta >= BUDGET_SYNC_BYTES || state.m_delta <= -BUDGET_SYNC_BYTES || state.m_exited) {
+        process_budget.m_used.fetch_add(state.m_delta, std::memory_order_relaxed);
+        state.m_delta = 0;
+    }
+}
+
+// Process usage as seen by the calling thread
+static inline size_t _budget_used() {
+    ptrdiff_t used = process_budget.m_used.load(std::memory_order_relaxed) + budget_state.m_delta;
+    return used > 0 ? (size_t)used : 0;
+}
+
+// Buddy heap over NumBlocks blocks of MinBlock << MaxOrder bytes. Orders
+// and block sizes are derived at compile time, and each instantiation is an
+// independent heap with its own lists, counters and lock.
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
 class Heap{
+public:
+    static constexpr size_t MIN_BLOCK_SIZE = MinBlock;
+    static constexpr int MAX_ORDER = MaxOrder;
+    static constexpr size_t MAX_BLOCK_SIZE = MinBlock << MaxOrder;
+    static constexpr size_t NUM_BLOCKS = NumBlocks;
+    static constexpr size_t RESERVED_BLOCKS = NumBlocks * SMALLOC_POOL_RESERVE;
+
+    // Block size of an order, header included
+    static constexpr size_t _order_size(int order) {
+        return MinBlock << order;
+    }
+
+    // Smallest order whose blocks hold `size` bytes, header included
+    static constexpr int _get_order(size_t size) {
+        return size <= MinBlock ? 0 : 64 - __builtin_clzll((size - 1) / MinBlock);
+    }
+
+    static_assert(MinBlock && (MinBlock & (MinBlock - 1)) == 0, "MinBlock must be a power of two");
+    static_assert(MinBlock > sizeof(MallocMetadata), "MinBlock must leave room after the block header");
+    static_assert(sizeof(MallocMetadata) % 16 == 0, "user pointers must stay 16-byte aligned");
+    static_assert(MaxOrder >= 0 && MaxOrder < STATS_MAX_ORDERS, "MaxOrder out of range");
+    static_assert(NumBlocks && (NumBlocks & (NumBlocks - 1)) == 0,
+                  "NumBlocks must be a power of two, the pool is aligned to its own size");
+    static_assert(SMALLOC_POOL_RESERVE > 0 && (SMALLOC_POOL_RESERVE & (SMALLOC_POOL_RESERVE - 1)) == 0,
+                  "SMALLOC_POOL_RESERVE must be a power of two");
+    static_assert(_get_order(MinBlock) == 0 && _get_order(MAX_BLOCK_SIZE) == MaxOrder &&
+                  _get_order(MAX_BLOCK_SIZE + 1) == MaxOrder + 1, "order table is inconsistent");
+    static_assert(_get_order(SMALLOC_MMAP_THRESHOLD_MAX) < STATS_MAX_ORDERS, "SMALLOC_MMAP_THRESHOLD_MAX too large");
+
 private:
     size_t _blocks_num;
     size_t _free_blocks_num;
@@ -98,16 +265,118 @@ private:
     list _allocated_blocks[MAX_ORDER + 1];
     list _free_blocks[MAX_ORDER + 1];
     bool _is_first_time;
+    pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+
+    // Cumulative counters reported by _get_stats()
+    size_t _mmap_blocks_num;
+    size_t _mmap_bytes;
+    size_t _calls[STAT_CALL_KINDS];
+    size_t _splits;
+    size_t _merges;
+    size_t _mmap_calls;
+    size_t _munmap_calls;
+
+    // Adaptive mmap threshold: blocks above MAX_BLOCK_SIZE and up to
+    // _mmap_threshold (header included) are power-of-two superblocks, which
+    // are cached by order when freed instead of unmapped
+    size_t _mmap_threshold;
+    list _cached_blocks[STATS_MAX_ORDERS];
+    size_t _cached_bytes;
+    size_t _threshold_raises;
+    size_t _cache_hits;
+
+    // SMALLOC_LAZY_COALESCE: blocks freed at each order without a merge
+    size_t _deferred[MAX_ORDER + 1];
+
+    // Buddy bitmap: one bit per inner node of each max-order block's buddy
+    // tree (numbered from 1 at the root, heap style), set while exactly one
+    // of the node's two halves is a free block. Merge decisions read it
+    // instead of the buddy's header.
+    static constexpr int MIN_BLOCK_SHIFT = __builtin_ctzll(MinBlock);
+    uint64_t* _buddy_map;
+    uintptr_t _pool_start;
+
+    // RESERVED_BLOCKS max-order blocks of address space are reserved for the
+    // pool, aligned to their size, and committed one after the other as the
+    // free lists run dry. The bitmap and the order map below are reserved for
+    // the whole range too and committed along with the blocks they describe.
+    ReservedRange _pool;
+    ReservedRange _map_range;
+    ReservedRange _orders_range;
+    size_t _pool_blocks;
+
+    // Out-of-band metadata: the page map resolves any address to its span,
+    // and the order of each allocated buddy block (plus one, 0 for anything
+    // else) is kept per MinBlock unit of the pool, so frees and size queries
+    // do not read the block's header
+    PageMap<Span> _page_map;
+    MetaPool<Span> _spans;
+    Span _pool_span;
+    uint8_t* _block_orders;
+
+    // Consistency checks: every _check_interval operations one superblock
+    // (round robin from _check_cursor) and the counters are verified
+    size_t _check_interval;
+    size_t _check_ops;
+    size_t _check_cursor;
+
+    // This heap's share of the process budget, exact under the lock: the
+    // bytes of blocks in use, headers included, plus cached superblocks. It
+    // has limits of its own as well (smalloc_budget_set_arena, 0 for none).
+    // Crossing this heap's or the process' soft limit scavenges and raises an
+    // event for the callback; nothing may take the heap or the process past
+    // its hard limit.
+    size_t _used_bytes;
+    size_t _budget_soft;
+    size_t _budget_hard;
+    bool _over_soft;
+    bool _budget_event;
+    BudgetCallback _budget_callback;
+    void* _budget_arg;
+
+    // Memory node the pool and the mmapped blocks are bound to, -1 for none
+    int _node;
+    void _bind(void* p, size_t bytes) const;
+
+    bool _check_fail(const char* what, const void* where) const;
+    bool _check_counters() const;
+    bool _check_superblock(size_t index, size_t* free_blocks, size_t* used_blocks) const;
+    bool _check_list(const list& blocks, int order, bool free) const;
+
+    bool _in_pool(const void* p) const;
+    size_t _unit(uintptr_t addr) const;
+    const Span* _find_span(const void* p) const;
+    bool _find_block(MallocMetadata* block, int& order, size_t& block_size) const;
+    size_t _pair_bit(uintptr_t addr, int order) const;
+    bool _buddy_is_free(uintptr_t addr, int order) const;
+    void _flip_free(uintptr_t addr, int order);
 
-    int _get_order(size_t size) const;
     MallocMetadata* _getMetaDataPtr(void* ptr) const;
     MallocMetadata* _get_best_fit_block(int order);
+    bool _grow_pool();
     void _div_buddies(int order);
-    void _merge_buddies(size_t order);
+    void _merge_buddies(MallocMetadata* block, int order);
+    void _coalesce(int order);
+    bool _release_block(MallocMetadata* block, int order, size_t block_size);
+    size_t _large_block_size(size_t size, int order) const;
+    MallocMetadata* _alloc_large(size_t size, int order);
+    void _release_large(MallocMetadata* block, int order, size_t block_size);
+    void _unmap_large(MallocMetadata* block, size_t block_size);
+    void _charge(size_t bytes);
+    void _uncharge(size_t bytes);
+    bool _within_hard(size_t bytes) const;
+    bool _budget_allows(size_t bytes);
+    void _scavenge();
 
 public:
     void _init();
-    Heap():_blocks_num(0),_free_blocks_num(0),_free_blocks_bytes(0),_all_bytes(0),_is_first_time(true){}
+    Heap():_blocks_num(0),_free_blocks_num(0),_free_blocks_bytes(0),_all_bytes(0),_is_first_time(true),
+           _mmap_blocks_num(0),_mmap_bytes(0),_calls(),_splits(0),_merges(0),_mmap_calls(0),_munmap_calls(0),
+           _mmap_threshold(MAX_BLOCK_SIZE),_cached_blocks(),_cached_bytes(0),_threshold_raises(0),_cache_hits(0),
+           _deferred(),_buddy_map(nullptr),_pool_start(0),_pool_blocks(0),_pool_span(),_block_orders(nullptr),
+           _check_interval(0),_check_ops(0),_check_cursor(0),
+           _used_bytes(0),_budget_soft(0),_budget_hard(0),_over_soft(false),_budget_event(false),
+           _budget_callback(nullptr),_budget_arg(nullptr),_node(-1){}
     size_t _get_blocks_num() const;
     size_t _get_allocated_blocks_bytes() const;
     size_t _get_free_blocks_num() const;
@@ -115,100 +384,197 @@ public:
     size_t _get_Metadata_size() const;
     size_t _get_block_size(void* p) const;
     size_t _get_all_bytes() const;
+    bool _owns(const void* p) const;
 
 
     void* _alloc_block(size_t size);
-    void _free_block(void* p);
-    bool _check_merge(void* oldp, size_t size);
-    void* _merge_blocks_if_needed(void* oldp, size_t size);
+    // Both return whether the block they released was sampled by the profiler
+    bool _free_block(void* p);
+    bool _free_block_sized(void* p, size_t size);
+    void* _grow_in_place(void* oldp, size_t size, bool& drop_sample);
+    void _set_sampled(void* p);
+    void _set_requested_size(void* p, size_t size);
+
+    void _count_call(StatCall call);
+    void _get_stats(HeapStats& stats) const;
+
+    // Verifies every block, list, the bitmap and the counters; on the first
+    // inconsistency writes it to stderr and returns false
+    bool _check_heap() const;
+    // 0 turns the incremental checks off; a failed one aborts
+    void _set_check_interval(size_t ops);
+
+    // Checks this heap's and the process' soft limits, as after an
+    // allocation, e.g. once the limits changed
+    void _budget_update();
+    // This heap's own limits; false when both are set and soft is above hard
+    bool _set_budget(size_t soft, size_t hard);
+    size_t _get_used_bytes() const;
+    void _set_budget_callback(BudgetCallback callback, void* arg);
+    // Hands out the pending budget event, if any, for the caller to run the
+    // callback once the heap lock is released
+    bool _take_budget_event(BudgetCallback& callback, void*& arg, size_t& used);
+
+    // Every public entry point holds the heap lock while touching the lists
+    void _lock_heap();
+    void _unlock_heap();
+
+    // Binds the memory the heap maps from now on to `node`; set before the
+    // first allocation
+    void _set_node(int node);
+    uintptr_t _get_pool_start() const;
+
+    // pthread_atfork handlers: keep the heap quiescent across fork()
+    void _prefork();
+    void _postfork_parent();
+    void _postfork_child();
 };
 
-int Heap::_get_order(size_t size) const {
-    size_t needed_size = static_cast<size_t>(ceil((size) / 128.0));
-    int order = std::ceil(std::log2(std::ceil(needed_size)));
-    return order;
-}
-MallocMetadata *Heap::_getMetaDataPtr(void *ptr) const {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+constexpr size_t Heap<MinBlock, MaxOrder, NumBlocks>::MIN_BLOCK_SIZE;
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+constexpr int Heap<MinBlock, MaxOrder, NumBlocks>::MAX_ORDER;
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+constexpr size_t Heap<MinBlock, MaxOrder, NumBlocks>::MAX_BLOCK_SIZE;
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+constexpr size_t Heap<MinBlock, MaxOrder, NumBlocks>::NUM_BLOCKS;
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+constexpr size_t Heap<MinBlock, MaxOrder, NumBlocks>::RESERVED_BLOCKS;
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+MallocMetadata *Heap<MinBlock, MaxOrder, NumBlocks>::_getMetaDataPtr(void *ptr) const {
     if(!ptr){
         return nullptr;
     }
     return (MallocMetadata *)((char *)ptr - sizeof(MallocMetadata));
 }
 
-size_t Heap::_get_all_bytes() const {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+size_t Heap<MinBlock, MaxOrder, NumBlocks>::_get_all_bytes() const {
     return _all_bytes;
 }
-void Heap::_init() {
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_lock_heap() {
+    pthread_mutex_lock(&_lock);
+}
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_unlock_heap() {
+    pthread_mutex_unlock(&_lock);
+}
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_prefork() {
+    // No allocation can be half way through its list updates once we hold the lock
+    _lock_heap();
+}
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_postfork_parent() {
+    _unlock_heap();
+}
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_postfork_child() {
+    // The thread that held the lock does not exist in the child, so the lists
+    // are consistent (we took the lock in _prefork) but the mutex must be rebuilt
+    pthread_mutex_init(&_lock, nullptr);
+}
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_init() {
     if (!_is_first_time) {
         return;
     }
     _is_first_time = false;
 
-    void* heap_break = sbrk(0);   // Get the current program break
-    size_t chunk_size = MAX_BLOCK_SIZE * NUM_BLOCKS; // 32 * 128 KB = 4 MB
-    intptr_t break_address = (intptr_t)(heap_break);
-
-    // Align the program break to the next multiple of chunk_size (4 MB)
-    intptr_t alignment = (break_address + chunk_size - 1) & ~(chunk_size - 1);
-    size_t alignment_offset = alignment - break_address;
-
-    // Adjust the program break to ensure alignment and allocate memory
-    void* newPtr = sbrk(chunk_size + alignment_offset);
-    if (!newPtr) {
+    size_t reserved = MAX_BLOCK_SIZE * RESERVED_BLOCKS; // 2048 * 128 KB = 256 MB by default
+    size_t units = RESERVED_BLOCKS << MaxOrder;
+    if (!_pool._reserve(reserved, reserved) || !_map_range._reserve((units + 63) / 64 * 8, 8) ||
+        !_orders_range._reserve(units, 1)) {
         return;
     }
-
-    // Adjust newPtr to the aligned starting address
-    newPtr = (char*)newPtr + alignment_offset;
+    _bind(_pool._start(), reserved);
+    _buddy_map = reinterpret_cast<uint64_t*>(_map_range._start());
+    _block_orders = reinterpret_cast<uint8_t*>(_orders_range._start());
+    _pool_start = reinterpret_cast<uintptr_t>(_pool._start());
+    _pool_span = {_pool_start, reserved, SPAN_BUDDY};
 
     // Initialize free and allocated block lists
     for (int i = 0; i <= MAX_ORDER; i++) {
         _free_blocks[i] = {nullptr, nullptr, 0};
         _allocated_blocks[i] = {nullptr, nullptr, 0};
     }
+}
 
-    // Initialize metadata for the 32 blocks and add them to the free list of MAX_ORDER
-    for (int i = 0; i < NUM_BLOCKS; i++) {
-        void* blockStart = (char*)newPtr + i * MAX_BLOCK_SIZE;
-        MallocMetadata* newMeta = reinterpret_cast<MallocMetadata*>(blockStart);
-
-        // Initialize metadata for each block
-        newMeta->m_is_free = true;
-        newMeta->m_data_size = MAX_BLOCK_SIZE - _get_Metadata_size(); // Usable size
-        newMeta->m_size = MAX_BLOCK_SIZE;                              // Total size
-        newMeta->m_next = nullptr;
-        newMeta->m_prev = nullptr;
-
-        // Insert block into the free list of MAX_ORDER
-        _free_blocks[MAX_ORDER].insert(newMeta);
+// Commits the next max-order block of the reserved pool and puts it on the
+// free list of MAX_ORDER; false once the whole pool is committed
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+bool Heap<MinBlock, MaxOrder, NumBlocks>::_grow_pool() {
+    if (!_pool_start) {
+        return false;
     }
-
-    // Update heap statistics
-    _free_blocks_num = NUM_BLOCKS;
-    _free_blocks_bytes = MAX_BLOCK_SIZE * NUM_BLOCKS - _get_Metadata_size() * NUM_BLOCKS;
-    _all_bytes = _free_blocks_bytes;
-    _blocks_num = NUM_BLOCKS;
-
+    // The bitmap, order map and page map entries of the next block are set
+    // up before the block is committed, so a failure anywhere leaves
+    // _pool_blocks matching the committed blocks. A retry extends the side
+    // maps by what is still missing.
+    size_t units = (_pool_blocks + 1) << MaxOrder;
+    size_t map_bytes = (units + 63) / 64 * 8;
+    char* next = _pool._start() + _pool._used_bytes();
+    if (_pool._used_bytes() + MAX_BLOCK_SIZE > _pool._size_bytes() ||
+        !_map_range._extend(map_bytes - _map_range._used_bytes()) ||
+        !_orders_range._extend(units - _orders_range._used_bytes()) ||
+        !_page_map._set(next, MAX_BLOCK_SIZE, &_pool_span)) {
+        return false;
+    }
+    void* blockStart;
+    {
+        HEAP_LATENCY(PROBE_COMMIT);
+        blockStart = _pool._extend(MAX_BLOCK_SIZE);
+    }
+    if (!blockStart) {
+        _page_map._set(next, MAX_BLOCK_SIZE, nullptr);
+        return false;
+    }
+    MallocMetadata* newMeta = reinterpret_cast<MallocMetadata*>(blockStart);
+    newMeta->m_is_free = true;
+    newMeta->m_data_size = MAX_BLOCK_SIZE - _get_Metadata_size(); // Usable size
+    newMeta->m_size = MAX_BLOCK_SIZE;                              // Total size
+    _free_blocks[MAX_ORDER].insert(newMeta);
+
+    _pool_blocks++;
+    _free_blocks_num++;
+    _free_blocks_bytes += newMeta->m_data_size;
+    _all_bytes += newMeta->m_data_size;
+    _blocks_num++;
+    return true;
 }
 
 
-size_t Heap::_get_blocks_num() const {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+size_t Heap<MinBlock, MaxOrder, NumBlocks>::_get_blocks_num() const {
     return _blocks_num;
 }
 
-size_t Heap::_get_free_blocks_num() const {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+size_t Heap<MinBlock, MaxOrder, NumBlocks>::_get_free_blocks_num() const {
     return _free_blocks_num;
 }
 
-size_t Heap::_get_free_blocks_bytes() const {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+size_t Heap<MinBlock, MaxOrder, NumBlocks>::_get_free_blocks_bytes() const {
     return _free_blocks_bytes;
 }
 
-size_t Heap::_get_Metadata_size() const {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+size_t Heap<MinBlock, MaxOrder, NumBlocks>::_get_Metadata_size() const {
     return sizeof(MallocMetadata);
 }
 
-void Heap::_div_buddies(int order) {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_div_buddies(int order) {
+    HEAP_LATENCY(PROBE_DIV_BUDDIES);
     int free_order = -1;
     for(int i = order + 1;i <=MAX_ORDER; i++){
         if(_free_blocks[i].m_size > 0){
@@ -240,21 +606,34 @@ void Heap::_div_buddies(int order) {
         _free_blocks[j].remove(temp);
         _free_blocks[j - 1].insert(buddy1);
         _free_blocks[j - 1].insert(buddy2);
+        // Both halves are free, so their pair's bit stays clear
+        _flip_free(reinterpret_cast<uintptr_t>(temp), j);
 
         _blocks_num++;
         _free_blocks_num++;
         _free_blocks_bytes -= _get_Metadata_size();
         _all_bytes -= _get_Metadata_size();
+        _splits++;
     }
 
 }
 
-MallocMetadata *Heap::_get_best_fit_block(int order) {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+MallocMetadata *Heap<MinBlock, MaxOrder, NumBlocks>::_get_best_fit_block(int order) {
     if (_free_blocks[order].m_size == 0) {
-        if (order == MAX_ORDER) {
-            return nullptr;
+        if (order < MAX_ORDER) {
+            _div_buddies(order);
+        }
+        if (SMALLOC_LAZY_COALESCE && _free_blocks[order].m_size == 0) {
+            // Nothing large enough: merge the deferred frees and look again
+            _coalesce(0);
+            if (order < MAX_ORDER) {
+                _div_buddies(order);
+            }
+        }
+        if (_free_blocks[order].m_size == 0 && _grow_pool() && order < MAX_ORDER) {
+            _div_buddies(order);
         }
-        _div_buddies(order);
         if (_free_blocks[order].m_size == 0) {
             return nullptr; // No block available even after splitting
         }
@@ -264,270 +643,1703 @@ MallocMetadata *Heap::_get_best_fit_block(int order) {
     if (!res) {
         return nullptr;
     }
+    if (_deferred[order]) {
+        _deferred[order]--;
+    }
 
     _free_blocks[order].remove(res);
-    _allocated_blocks[order].insert(res);
+#if SMALLOC_PREFETCH
+    // remove() just wrote the new head; its successor is written by the next
+    // pop (m_prev is cleared) and is usually a cold line of another block
+    if (_free_blocks[order].m_head) {
+        __builtin_prefetch(_free_blocks[order].m_head->m_next, 1, 3);
+    }
+#endif
+#if SMALLOC_PREFETCH >= 2
+    if (_order_size(order) > 64) {
+        __builtin_prefetch(reinterpret_cast<char*>(res) + 64, 1, 3);
+    }
+#endif
+    _flip_free(reinterpret_cast<uintptr_t>(res), order);
+    _block_orders[_unit(reinterpret_cast<uintptr_t>(res))] = order + 1;
+    _allocated_blocks[order].push(res);
     _free_blocks_bytes -= res->m_data_size;
+    _charge(_order_size(order));
 
     res->m_is_free = false;
+    res->m_is_sampled = false;
     return res;
 }
 
-void* Heap::_alloc_block(size_t size) {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void* Heap<MinBlock, MaxOrder, NumBlocks>::_alloc_block(size_t size) {
     int ord = _get_order(size + sizeof(MallocMetadata));
+    if (!_budget_allows(ord > MAX_ORDER ? _large_block_size(size, ord) : _order_size(ord))) {
+        return nullptr;
+    }
 
+    MallocMetadata *ptr;
     if (ord > MAX_ORDER) {
-        void *ptr = mmap(nullptr, size + sizeof(MallocMetadata),
-                         PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
-        if (ptr == (void *) -1) {
-            return nullptr;
-        }
-
-        MallocMetadata *newBlock = (MallocMetadata *) ptr;
-        newBlock->m_data_size = size;
-        newBlock->m_size = size + _get_Metadata_size();
-        newBlock->m_next = nullptr;
-        newBlock->m_prev = nullptr;
-        newBlock->m_is_free = false;
-
-        _blocks_num++;
-        _all_bytes += newBlock->m_data_size;
-
-        return newBlock;
-
+        ptr = _alloc_large(size, ord);
     } else {
-        MallocMetadata *ptr = _get_best_fit_block(ord);
+        ptr = _get_best_fit_block(ord);
         if (ptr) {
+            ptr->m_requested_size = size;
             _free_blocks_num--;
-            return ptr;
         }
-        return nullptr;
     }
+    if (ptr) {
+        _budget_update();
+    }
+    return ptr;
+}
+
+// Pointers this heap did not hand out, and buddy blocks that are already
+// free, are ignored
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+bool Heap<MinBlock, MaxOrder, NumBlocks>::_free_block(void* p) {
+    MallocMetadata* temp = _getMetaDataPtr(p);
+    int order;
+    size_t block_size;
+    if (!temp || !_find_block(temp, order, block_size)) {
+        return false;
+    }
+    bool sampled = temp->m_is_sampled;
+    return _release_block(temp, order, block_size) && sampled;
 }
 
-void Heap::_free_block(void* p) {
+// `size` is what the block was allocated with, so a buddy block's order is
+// computed rather than found through the page map; one byte of the order map,
+// out of band, confirms it. Any other size (a block srealloc resized in
+// place, or a wrong size) falls back to the lookup of _free_block, so the
+// block is never filed under the wrong order.
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+bool Heap<MinBlock, MaxOrder, NumBlocks>::_free_block_sized(void* p, size_t size) {
     MallocMetadata* temp = _getMetaDataPtr(p);
     if (!temp) {
-        return;
+        return false;
     }
+    uintptr_t addr = reinterpret_cast<uintptr_t>(temp);
+    int order = _get_order(size + sizeof(MallocMetadata));
+    size_t block_size;
+    if (order <= MAX_ORDER && _in_pool(temp) && !(addr & (MinBlock - 1)) &&
+        _block_orders[_unit(addr)] == order + 1) {
+        block_size = _order_size(order);
+    } else if (!_find_block(temp, order, block_size)) {
+        return false;
+    }
+    bool sampled = temp->m_is_sampled;
+    return _release_block(temp, order, block_size) && sampled;
+}
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+bool Heap<MinBlock, MaxOrder, NumBlocks>::_release_block(MallocMetadata* temp, int order, size_t size) {
     if (temp->m_is_free) {
-        return;
+        return false;
     }
     temp->m_is_free = true;
-    size_t order = _get_order(temp->m_size);
-    if (temp->m_size > MAX_BLOCK_SIZE)
+    if (order > MAX_ORDER)
     {
-        size_t size = temp->m_size;
-        munmap(temp, size);
-        _blocks_num--;
-        _all_bytes -= (size - _get_Metadata_size());
+        _release_large(temp, order, size);
     }
     else
     {
 
         _allocated_blocks[order].remove(temp);
         _free_blocks[order].insert(temp);
+        _flip_free(reinterpret_cast<uintptr_t>(temp), order);
+        _block_orders[_unit(reinterpret_cast<uintptr_t>(temp))] = 0;
         _free_blocks_num++;
         _free_blocks_bytes += temp->m_data_size;
-        _merge_buddies(order);
+        _uncharge(size);
+        if (SMALLOC_LAZY_COALESCE) {
+            // Left unmerged for the next allocation of this order
+            if (++_deferred[order] > SMALLOC_LAZY_WATERMARK) {
+                HEAP_LATENCY(PROBE_MERGE_BUDDIES);
+                _coalesce(order);
+            }
+            return true;
+        }
+        {
+            // Timed here rather than inside the recursion
+            HEAP_LATENCY(PROBE_MERGE_BUDDIES);
+            _merge_buddies(temp, order);
+        }
     }
+    return true;
 }
-void Heap::_merge_buddies(size_t order) {
-    if(order == MAX_ORDER){
-        return;
+// Blocks above MAX_BLOCK_SIZE. Up to the mmap threshold they are rounded to
+// their order's size and taken from the cache when one was freed before;
+// above it they are mapped at their exact size.
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+size_t Heap<MinBlock, MaxOrder, NumBlocks>::_large_block_size(size_t size, int order) const {
+    if (_order_size(order) <= _mmap_threshold) {
+        return _order_size(order);
     }
-    MallocMetadata* currBlock = _free_blocks[order].m_head;
-    if(!currBlock){ //i think its rudnadnt
-        return;
-    }
-    while(currBlock && currBlock->m_next){
-        intptr_t buddy_address = reinterpret_cast<intptr_t>(currBlock) ^ currBlock->m_size;
-        if (buddy_address == reinterpret_cast<intptr_t>(currBlock->m_next)){
-
-            MallocMetadata* nextBlock = currBlock->m_next;
-            _free_blocks[order].remove(currBlock);
-            _free_blocks[order].remove(nextBlock);
-            _free_blocks[order + 1].insert(currBlock);
-
-            currBlock->m_data_size += nextBlock->m_size;
-            currBlock->m_size += nextBlock->m_size;
+    // The tail of the last page is usable as well
+    return (size + _get_Metadata_size() + MMAP_PAGE_SIZE - 1) & ~(size_t)(MMAP_PAGE_SIZE - 1);
+}
 
-            _blocks_num--;
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+MallocMetadata* Heap<MinBlock, MaxOrder, NumBlocks>::_alloc_large(size_t size, int order) {
+    size_t block_size = _large_block_size(size, order);
+    if (_order_size(order) <= _mmap_threshold) {
+        MallocMetadata* cached = _cached_blocks[order].m_head;
+        if (cached) {
+            _cached_blocks[order].remove(cached);
+            _cached_bytes -= block_size;
             _free_blocks_num--;
-            _free_blocks_bytes += _get_Metadata_size();
-            _all_bytes += _get_Metadata_size();
-            _merge_buddies(order + 1);
-            return;
+            _free_blocks_bytes -= cached->m_data_size;
+            _cache_hits++;
+            cached->m_is_free = false;
+            cached->m_is_sampled = false;
+            cached->m_requested_size = size;
+            return cached;
+        }
+    }
 
+    void *ptr;
+    {
+        HEAP_LATENCY(PROBE_MMAP);
+        ptr = mmap(nullptr, block_size,
+                   PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    }
+    _mmap_calls++;
+    if (ptr == (void *) -1) {
+        return nullptr;
+    }
+    Span* span = _spans._allocate();
+    if (!span || !_page_map._set(ptr, block_size, span)) {
+        if (span) {
+            _spans._deallocate(span);
         }
-        currBlock = currBlock->m_next;
+        munmap(ptr, block_size);
+        _munmap_calls++;
+        return nullptr;
     }
+    *span = {reinterpret_cast<uintptr_t>(ptr), block_size, SPAN_MMAP};
+    _bind(ptr, block_size);
+
+    MallocMetadata *newBlock = (MallocMetadata *) ptr;
+    newBlock->m_data_size = block_size - _get_Metadata_size();
+    newBlock->m_size = block_size;
+    newBlock->m_next = nullptr;
+    newBlock->m_prev = nullptr;
+    newBlock->m_is_free = false;
+    newBlock->m_is_sampled = false;
+    newBlock->m_requested_size = size;
+
+    _blocks_num++;
+    _all_bytes += newBlock->m_data_size;
+    _mmap_blocks_num++;
+    _mmap_bytes += newBlock->m_size;
+    _charge(newBlock->m_size);
+
+    return newBlock;
 }
-size_t Heap::_get_block_size(void* p) const {
-    MallocMetadata* curr = _getMetaDataPtr(p);
-    if(curr){
-        return curr->m_data_size;
+
+// Keeps a freed superblock while the cache has room and unmaps anything else.
+// Like glibc, unmapping a block above the threshold raises the threshold to
+// the block's order (up to SMALLOC_MMAP_THRESHOLD_MAX): a program that frees
+// blocks of that size will likely allocate them again, and the next one is
+// then cached rather than paying for mmap and munmap once more.
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_release_large(MallocMetadata* temp, int order, size_t size) {
+    if (size == _order_size(order) && size <= _mmap_threshold &&
+        _cached_bytes + size <= MMAP_CACHE_FACTOR * _mmap_threshold) {
+        _cached_blocks[order].insert(temp);
+        _cached_bytes += size;
+        _free_blocks_num++;
+        _free_blocks_bytes += temp->m_data_size;
+        return;
+    }
+
+    _unmap_large(temp, size);
+    if (size > _mmap_threshold && _order_size(order) <= SMALLOC_MMAP_THRESHOLD_MAX) {
+        _mmap_threshold = _order_size(order);
+        _threshold_raises++;
     }
-    return -1;
 }
 
-bool Heap::_check_merge(void *oldp, size_t size) {
-    MallocMetadata* p = _getMetaDataPtr(oldp);
-    size_t curr_size = p->m_size;
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_unmap_large(MallocMetadata* temp, size_t size) {
+    Span* span = _page_map._get(temp);
+    _page_map._set(temp, size, nullptr);
+    _spans._deallocate(span);
+    {
+        HEAP_LATENCY(PROBE_MUNMAP);
+        munmap(temp, size);
+    }
+    _blocks_num--;
+    _all_bytes -= (size - _get_Metadata_size());
+    _munmap_calls++;
+    _mmap_blocks_num--;
+    _mmap_bytes -= size;
+    _uncharge(size);
+}
 
-    while (true) {
-        // Compute the next block by moving `curr_size + metadata_size` forward
-        MallocMetadata* next_block = reinterpret_cast<MallocMetadata*>(
-                reinterpret_cast<intptr_t>(p) ^ p->m_size);
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_charge(size_t bytes) {
+    _used_bytes += bytes;
+    _budget_add((ptrdiff_t)bytes);
+}
 
-        // Ensure the next block is valid and free before merging
-        if (!next_block || !next_block->m_is_free || curr_size >= (size+_get_Metadata_size())) {
-            break;
-        }
-        curr_size += next_block->m_size;
-        p = next_block;                     // Move pointer to the merged block
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_uncharge(size_t bytes) {
+    _used_bytes -= bytes;
+    _budget_add(-(ptrdiff_t)bytes);
+}
 
+// Whether `bytes` more keep this heap and the process within their hard
+// limits
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+bool Heap<MinBlock, MaxOrder, NumBlocks>::_within_hard(size_t bytes) const {
+    size_t hard = process_budget.m_hard.load(std::memory_order_relaxed);
+    return (!_budget_hard || _used_bytes + bytes <= _budget_hard) && (!hard || _budget_used() + bytes <= hard);
+}
 
+// Whether `bytes` more are within the hard limits, after giving back what
+// this heap can give back if they are not. A refusal raises a budget event,
+// so the callback can shed memory before the caller tries again.
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+bool Heap<MinBlock, MaxOrder, NumBlocks>::_budget_allows(size_t bytes) {
+    if (_within_hard(bytes)) {
+        return true;
     }
-
-    return curr_size >= (size + _get_Metadata_size());
+    _scavenge();
+    if (_within_hard(bytes)) {
+        return true;
+    }
+    _budget_event = true;
+    return false;
 }
-void* Heap::_merge_blocks_if_needed(void *oldp, size_t size) {
-    MallocMetadata* p = _getMetaDataPtr(oldp);
-    size_t curr_size = p->m_size;
-
-    int remove_index = _get_order(p->m_size);
-    _allocated_blocks[remove_index].remove(p);
 
-    while (true) {
-        // Compute the next block location
-        MallocMetadata* next_block = (MallocMetadata*)(reinterpret_cast<intptr_t>(p) xor p->m_size);
+// Scavenges and raises an event once each time this heap goes over its
+// soft limit, or the process over its own, in the heap that took it over;
+// falling back under a limit re-arms it
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_budget_update() {
+    bool crossed = false;
+    if (_budget_soft) {
+        if (_used_bytes <= _budget_soft) {
+            _over_soft = false;
+        } else if (!_over_soft) {
+            _over_soft = true;
+            crossed = true;
+        }
+    }
+    size_t soft = process_budget.m_soft.load(std::memory_order_relaxed);
+    if (soft) {
+        if (_budget_used() <= soft) {
+            process_budget.m_over_soft.store(false, std::memory_order_relaxed);
+        } else if (!process_budget.m_over_soft.exchange(true, std::memory_order_relaxed)) {
+            crossed = true;
+        }
+    }
+    if (crossed) {
+        _budget_event = true;
+        _scavenge();
+    }
+}
 
-        // Stop merging if:
-        // 1. The next block is not valid.
-        // 2. The next block is not free.
-        // 3. The total merged size already reaches/exceeds the required `size`.
-        if (!next_block || !next_block->m_is_free || curr_size >= (size + _get_Metadata_size())) {
-            break;
+// Gives memory back to the system: unmaps the cached superblocks, merges
+// deferred frees, and drops the pages of free max-order blocks, except the
+// one holding the header, with MADV_DONTNEED
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_scavenge() {
+    for (int i = MAX_ORDER + 1; i < STATS_MAX_ORDERS; i++) {
+        while (MallocMetadata* cached = _cached_blocks[i].m_head) {
+            _cached_blocks[i].remove(cached);
+            _cached_bytes -= cached->m_size;
+            _free_blocks_num--;
+            _free_blocks_bytes -= cached->m_data_size;
+            _unmap_large(cached, cached->m_size);
         }
+    }
+    if (SMALLOC_LAZY_COALESCE) {
+        _coalesce(0);
+    }
+    if (MAX_BLOCK_SIZE >= 2 * MMAP_PAGE_SIZE) {
+        for (MallocMetadata* block = _free_blocks[MAX_ORDER].m_head; block; block = block->m_next) {
+            madvise((char*)block + MMAP_PAGE_SIZE, MAX_BLOCK_SIZE - MMAP_PAGE_SIZE, MADV_DONTNEED);
+        }
+    }
+}
 
-        int order = _get_order(next_block->m_size);
-        _free_blocks[order].remove(next_block);
-        curr_size += next_block->m_size;
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+bool Heap<MinBlock, MaxOrder, NumBlocks>::_in_pool(const void* p) const {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+    return addr >= _pool_start && addr - _pool_start < MAX_BLOCK_SIZE * _pool_blocks;
+}
 
-        _blocks_num--;
-        _free_blocks_num--;
-        _all_bytes += _get_Metadata_size();
-        _free_blocks_bytes -= next_block->m_data_size;
+// Index of the MinBlock unit at `addr`, which must be in the pool
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+inline size_t Heap<MinBlock, MaxOrder, NumBlocks>::_unit(uintptr_t addr) const {
+    return (addr - _pool_start) >> MIN_BLOCK_SHIFT;
+}
 
-        next_block->m_is_free = false;  // Mark the merged block as used (prevent reuse)
+// Span holding `p`, or nullptr when the heap never mapped that address
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+inline const Span* Heap<MinBlock, MaxOrder, NumBlocks>::_find_span(const void* p) const {
+    const Span* span = _page_map._get(p);
+    uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+    if (!span || addr < span->m_start || addr - span->m_start >= span->m_bytes) {
+        return nullptr;
+    }
+    return span;
+}
 
-        // Ensure the leftmost block (earlier address) is used as the merged block
-        if (reinterpret_cast<intptr_t>(next_block) < reinterpret_cast<intptr_t>(p)) {
-            p = next_block;
+// Order and size of the allocated block whose header is at `block`; false
+// when no allocated block starts there
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+bool Heap<MinBlock, MaxOrder, NumBlocks>::_find_block(MallocMetadata* block, int& order, size_t& block_size) const {
+    const Span* span = _find_span(block);
+    if (!span) {
+        return false;
+    }
+    uintptr_t addr = reinterpret_cast<uintptr_t>(block);
+    if (span->m_kind == SPAN_MMAP) {
+        if (addr != span->m_start) {
+            return false;
         }
+        block_size = span->m_bytes;
+        order = _get_order(block_size);
+        return true;
     }
+    if (addr & (MinBlock - 1)) {
+        return false;
+    }
+    order = _block_orders[_unit(addr)] - 1;
+    if (order < 0) {
+        return false;
+    }
+    block_size = _order_size(order);
+    return true;
+}
 
-    // Update the metadata of the new merged block
-    p->m_size = curr_size;
-    p->m_data_size = curr_size - _get_Metadata_size();
-    int index = _get_order(curr_size);
-    _allocated_blocks[index].insert(p);
-
-    // Return the newly merged block pointer
-    return (char*)p + _get_Metadata_size();
+// Bit of the pair that the block at `order` starting at `addr` belongs to;
+// the block must be in the pool and below MAX_ORDER
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+inline size_t Heap<MinBlock, MaxOrder, NumBlocks>::_pair_bit(uintptr_t addr, int order) const {
+    uintptr_t offset = addr - _pool_start;
+    size_t superblock = offset >> (MIN_BLOCK_SHIFT + MaxOrder);
+    size_t index = (offset & (MAX_BLOCK_SIZE - 1)) >> (MIN_BLOCK_SHIFT + order + 1);
+    return (superblock << MaxOrder) + ((size_t)1 << (MaxOrder - order - 1)) + index;
 }
 
-Heap heap;
+// Whether the buddy of a block that is not free itself is a free block
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+inline bool Heap<MinBlock, MaxOrder, NumBlocks>::_buddy_is_free(uintptr_t addr, int order) const {
+    size_t bit = _pair_bit(addr, order);
+    return (_buddy_map[bit / 64] >> (bit % 64)) & 1;
+}
 
-void* smalloc(size_t size){
-    heap._init();
-    if (size <= 0 || size > MAX_MEM)
-    {
-        return nullptr;
+// Called whenever a block becomes free or stops being free
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+inline void Heap<MinBlock, MaxOrder, NumBlocks>::_flip_free(uintptr_t addr, int order) {
+    if (order < MAX_ORDER) {
+        size_t bit = _pair_bit(addr, order);
+        _buddy_map[bit / 64] ^= (uint64_t)1 << (bit % 64);
     }
-    void *ptr = heap._alloc_block(size);
+}
 
-    return (!ptr) ? nullptr : (char *)ptr + heap._get_Metadata_size();
+// Merges a freed block with its buddy, and the result with its own buddy,
+// for as long as the buddy is a free block. The bitmap answers that without
+// touching the buddy's memory: with the block free, a clear pair bit means
+// the buddy is free as well.
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_merge_buddies(MallocMetadata* block, int order) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(block);
+    while (order < MAX_ORDER && !_buddy_is_free(addr, order)) {
+        uintptr_t buddy_addr = addr ^ _order_size(order);
+        // Both halves stop being free blocks, so the pair bit stays clear
+        _free_blocks[order].remove(reinterpret_cast<MallocMetadata*>(addr));
+        _free_blocks[order].remove(reinterpret_cast<MallocMetadata*>(buddy_addr));
+
+        addr = addr < buddy_addr ? addr : buddy_addr;
+        MallocMetadata* merged = reinterpret_cast<MallocMetadata*>(addr);
+        merged->m_size = _order_size(order + 1);
+        merged->m_data_size = merged->m_size - _get_Metadata_size();
+        merged->m_is_free = true;
+        order++;
+        _free_blocks[order].insert(merged);
+        _flip_free(addr, order);
 
+        _blocks_num--;
+        _free_blocks_num--;
+        _free_blocks_bytes += _get_Metadata_size();
+        _all_bytes += _get_Metadata_size();
+        _merges++;
+    }
 }
-void *scalloc(size_t num, size_t size)
-{
-    void *res = smalloc(num * size);
 
-    if (res == nullptr)
-    {
-        return nullptr;
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_coalesce(int order) {
+    for (int i = order; i < MAX_ORDER; i++) {
+        _deferred[i] = 0;
+        MallocMetadata* currBlock = _free_blocks[i].m_head;
+        while (currBlock && currBlock->m_next) {
+            MallocMetadata* nextBlock = currBlock->m_next;
+            intptr_t buddy_address = reinterpret_cast<intptr_t>(currBlock) ^ currBlock->m_size;
+            if (buddy_address != reinterpret_cast<intptr_t>(nextBlock)) {
+                currBlock = nextBlock;
+                continue;
+            }
+            MallocMetadata* following = nextBlock->m_next;
+            _free_blocks[i].remove(currBlock);
+            _free_blocks[i].remove(nextBlock);
+            currBlock->m_data_size += nextBlock->m_size;
+            currBlock->m_size += nextBlock->m_size;
+            _free_blocks[i + 1].insert(currBlock);
+            _flip_free(reinterpret_cast<uintptr_t>(currBlock), i + 1);
+
+            _blocks_num--;
+            _free_blocks_num--;
+            _free_blocks_bytes += _get_Metadata_size();
+            _all_bytes += _get_Metadata_size();
+            _merges++;
+            currBlock = following;
+        }
     }
+    _deferred[MAX_ORDER] = 0;
+}
 
-    memset(res, 0, num * size);
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+size_t Heap<MinBlock, MaxOrder, NumBlocks>::_get_block_size(void* p) const {
+    MallocMetadata* curr = _getMetaDataPtr(p);
+    int order;
+    size_t block_size;
+    if(curr && _find_block(curr, order, block_size)){
+        return block_size - _get_Metadata_size();
+    }
+    return -1;
+}
 
-    return res;
+// Whether `p` points into the buddy pool or into an mmapped block the heap
+// still holds (in use or cached)
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+bool Heap<MinBlock, MaxOrder, NumBlocks>::_owns(const void* p) const {
+    return _find_span(p) != nullptr;
 }
 
-void sfree(void *ptr)
-{
-    if (ptr == nullptr)
-    {
-        return;
-    }
-    heap._free_block(ptr);
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_set_sampled(void* p) {
+    _getMetaDataPtr(p)->m_is_sampled = true;
 }
 
-void *srealloc(void *oldp, size_t size)
-{
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_set_requested_size(void* p, size_t size) {
+    _getMetaDataPtr(p)->m_requested_size = size;
+}
 
-    if (size <= 0 || size > MAX_MEM)
-    {
-        return nullptr;
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_count_call(StatCall call) {
+    if (call < STAT_CALL_KINDS) {
+        _calls[call]++;
     }
-
-    if (oldp == nullptr)
-    {
-        return smalloc(size);
+    if (_check_interval && ++_check_ops >= _check_interval) {
+        _check_ops = 0;
+        size_t index = _check_cursor;
+        _check_cursor = _check_cursor + 1 < _pool_blocks ? _check_cursor + 1 : 0;
+        if (!_check_counters() || !_check_superblock(index, nullptr, nullptr)) {
+            abort();
+        }
     }
+}
 
-    if (heap._get_block_size(oldp) >= size)
-    {
-        return oldp;
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_get_stats(HeapStats& stats) const {
+    memset(&stats, 0, sizeof(stats));
+    stats.m_num_orders = MAX_ORDER + 1;
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        OrderStats& o = stats.m_orders[i];
+        o.m_block_size = _order_size(i);
+        o.m_free_blocks = _free_blocks[i].m_size;
+        o.m_free_bytes = o.m_free_blocks * o.m_block_size;
+        o.m_allocated_blocks = _allocated_blocks[i].m_size;
+        o.m_allocated_bytes = o.m_allocated_blocks * o.m_block_size;
+        for (MallocMetadata* m = _allocated_blocks[i].m_head; m; m = m->m_next) {
+            o.m_requested_bytes += m->m_requested_size;
+        }
     }
-    if(heap._check_merge(oldp,size)){
-        return heap._merge_blocks_if_needed(oldp,size);
+    heap_stats_finish(stats);
+
+    stats.m_mmap_blocks = _mmap_blocks_num;
+    stats.m_mmap_bytes = _mmap_bytes;
+    memcpy(stats.m_calls, _calls, sizeof(_calls));
+    stats.m_splits = _splits;
+    stats.m_merges = _merges;
+    stats.m_mmap_calls = _mmap_calls;
+    stats.m_munmap_calls = _munmap_calls;
+    stats.m_mmap_threshold = _mmap_threshold;
+    stats.m_mmap_threshold_raises = _threshold_raises;
+    for (int i = MAX_ORDER + 1; i < STATS_MAX_ORDERS; i++) {
+        stats.m_cached_blocks += _cached_blocks[i].m_size;
     }
+    stats.m_cached_bytes = _cached_bytes;
+    stats.m_cache_hits = _cache_hits;
+}
 
-    void *res = smalloc(size);
-    sfree(oldp);
+// Written with write(2): the heap lock is held, so nothing here may allocate
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+bool Heap<MinBlock, MaxOrder, NumBlocks>::_check_fail(const char* what, const void* where) const {
+    char msg[160];
+    int len = snprintf(msg, sizeof(msg), "smalloc heap check: %s at %p\n", what, where);
+    if (len > 0) {
+        ssize_t ignored = write(STDERR_FILENO, msg, (size_t)len < sizeof(msg) ? (size_t)len : sizeof(msg) - 1);
+        (void)ignored;
+    }
+    return false;
+}
 
-    if (res == nullptr)
-    {
-        return nullptr;
+// The counters against the list lengths, O(orders). Every buddy block is on
+// a free or allocated list, every mmapped block is counted in _mmap_blocks_num,
+// and cached superblocks count as free.
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+bool Heap<MinBlock, MaxOrder, NumBlocks>::_check_counters() const {
+    size_t blocks = _mmap_blocks_num;
+    size_t free_blocks = 0;
+    size_t free_bytes = 0;
+    size_t all_bytes = _mmap_bytes - _mmap_blocks_num * _get_Metadata_size();
+    size_t cached_bytes = 0;
+    size_t used_bytes = _mmap_bytes;
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        size_t data = _order_size(i) - _get_Metadata_size();
+        used_bytes += _allocated_blocks[i].m_size * _order_size(i);
+        blocks += _free_blocks[i].m_size + _allocated_blocks[i].m_size;
+        free_blocks += _free_blocks[i].m_size;
+        free_bytes += _free_blocks[i].m_size * data;
+        all_bytes += (_free_blocks[i].m_size + _allocated_blocks[i].m_size) * data;
+    }
+    for (int i = MAX_ORDER + 1; i < STATS_MAX_ORDERS; i++) {
+        free_blocks += _cached_blocks[i].m_size;
+        free_bytes += _cached_blocks[i].m_size * (_order_size(i) - _get_Metadata_size());
+        cached_bytes += _cached_blocks[i].m_size * _order_size(i);
+    }
+    if (blocks != _blocks_num) {
+        return _check_fail("_blocks_num does not match the lists", this);
+    }
+    if (free_blocks != _free_blocks_num) {
+        return _check_fail("_free_blocks_num does not match the lists", this);
+    }
+    if (free_bytes != _free_blocks_bytes) {
+        return _check_fail("_free_blocks_bytes does not match the lists", this);
+    }
+    if (all_bytes != _all_bytes) {
+        return _check_fail("_all_bytes does not match the lists", this);
+    }
+    if (cached_bytes != _cached_bytes) {
+        return _check_fail("_cached_bytes does not match the cache", this);
+    }
+    if (used_bytes != _used_bytes) {
+        return _check_fail("_used_bytes does not match the lists", this);
     }
+    return true;
+}
 
-    memmove(res, oldp, size);
+// Walks one max-order block of the pool through the block headers: every
+// block must be a whole aligned buddy block whose header, order byte and
+// free flag agree, and each pair bit must be the parity of the free halves.
+// The blocks found are added to the per-order counts when they are given.
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+bool Heap<MinBlock, MaxOrder, NumBlocks>::_check_superblock(size_t index, size_t* free_blocks,
+                                                           size_t* used_blocks) const {
+    if (index >= _pool_blocks) {
+        return true; // Not committed yet
+    }
+    uintptr_t start = _pool_start + index * MAX_BLOCK_SIZE;
+    uintptr_t end = start + MAX_BLOCK_SIZE;
+    uint64_t expected[((size_t)1 << MaxOrder) / 64 + 1] = {};
+
+    for (uintptr_t addr = start; addr < end;) {
+        const MallocMetadata* block = reinterpret_cast<const MallocMetadata*>(addr);
+        size_t size = block->m_size;
+        int order = size >= MinBlock && size <= MAX_BLOCK_SIZE ? _get_order(size) : -1;
+        if (order < 0 || _order_size(order) != size) {
+            return _check_fail("block size is not a buddy order", block);
+        }
+        if ((addr - start) & (size - 1)) {
+            return _check_fail("block is not aligned to its size", block);
+        }
+        if (block->m_data_size != size - _get_Metadata_size()) {
+            return _check_fail("block data size does not match its size", block);
+        }
+        size_t unit = _unit(addr);
+        if (_block_orders[unit] != (block->m_is_free ? 0 : order + 1)) {
+            return _check_fail("order map does not match the block header", block);
+        }
+        for (size_t u = unit + 1; u < unit + (size >> MIN_BLOCK_SHIFT); u++) {
+            if (_block_orders[u]) {
+                return _check_fail("order map marks the inside of a block", block);
+            }
+        }
+        if (block->m_is_free) {
+            if (order < MAX_ORDER) {
+                size_t bit = _pair_bit(addr, order) - (index << MaxOrder);
+                expected[bit / 64] ^= (uint64_t)1 << (bit % 64);
+            }
+            if (!SMALLOC_LAZY_COALESCE && order < MAX_ORDER && addr & size) {
+                // Eager merging never leaves two free buddies; checked from the upper one
+                const MallocMetadata* buddy = reinterpret_cast<const MallocMetadata*>(addr ^ size);
+                if (buddy->m_is_free && buddy->m_size == size) {
+                    return _check_fail("free buddies were not merged", buddy);
+                }
+            }
+        }
+        if (free_blocks && block->m_is_free) {
+            free_blocks[order]++;
+        } else if (used_blocks && !block->m_is_free) {
+            used_blocks[order]++;
+        }
+        addr += size;
+    }
 
-    return res;
+    for (size_t bit = 1; bit < ((size_t)1 << MaxOrder); bit++) {
+        size_t map_bit = (index << MaxOrder) + bit;
+        if (((_buddy_map[map_bit / 64] >> (map_bit % 64)) & 1) != ((expected[bit / 64] >> (bit % 64)) & 1)) {
+            return _check_fail("buddy bitmap does not match the free blocks", reinterpret_cast<void*>(start));
+        }
+    }
+    return true;
 }
 
-size_t _num_free_blocks() {
-    return heap._get_free_blocks_num();
+// Links, membership and length of one free, allocated or cache list
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+bool Heap<MinBlock, MaxOrder, NumBlocks>::_check_list(const list& blocks, int order, bool free) const {
+    size_t count = 0;
+    const MallocMetadata* prev = nullptr;
+    for (const MallocMetadata* m = blocks.m_head; m; prev = m, m = m->m_next) {
+        if (++count > blocks.m_size) {
+            return _check_fail("list is longer than its size (or has a cycle)", &blocks);
+        }
+        if (m->m_prev != prev) {
+            return _check_fail("list back link is broken", m);
+        }
+        if (m->m_is_free != free || m->m_size != _order_size(order)) {
+            return _check_fail("list holds a block of another kind or order", m);
+        }
+        if (order <= MAX_ORDER) {
+            if (!_in_pool(m)) {
+                return _check_fail("buddy list holds a block outside the pool", m);
+            }
+        } else {
+            const Span* span = _find_span(m);
+            if (!span || span->m_kind != SPAN_MMAP || span->m_start != reinterpret_cast<uintptr_t>(m)) {
+                return _check_fail("cached superblock is not in the page map", m);
+            }
+        }
+    }
+    if (count != blocks.m_size || blocks.m_tail != prev) {
+        return _check_fail("list size or tail is wrong", &blocks);
+    }
+    return true;
 }
 
-size_t _num_free_bytes() {
-    return heap._get_free_blocks_bytes();
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+bool Heap<MinBlock, MaxOrder, NumBlocks>::_check_heap() const {
+    if (!_check_counters()) {
+        return false;
+    }
+    if (_pool_blocks && _find_span(reinterpret_cast<void*>(_pool_start)) != &_pool_span) {
+        return _check_fail("pool is not in the page map", reinterpret_cast<void*>(_pool_start));
+    }
+    size_t free_blocks[MAX_ORDER + 1] = {};
+    size_t used_blocks[MAX_ORDER + 1] = {};
+    for (size_t i = 0; i < _pool_blocks; i++) {
+        if (!_check_superblock(i, free_blocks, used_blocks)) {
+            return false;
+        }
+    }
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        if (!_check_list(_free_blocks[i], i, true) || !_check_list(_allocated_blocks[i], i, false)) {
+            return false;
+        }
+        if (free_blocks[i] != _free_blocks[i].m_size || used_blocks[i] != _allocated_blocks[i].m_size) {
+            return _check_fail("list lengths do not match the blocks in the pool", &_free_blocks[i]);
+        }
+    }
+    for (int i = MAX_ORDER + 1; i < STATS_MAX_ORDERS; i++) {
+        if (!_check_list(_cached_blocks[i], i, true)) {
+            return false;
+        }
+    }
+    return true;
 }
 
-size_t _num_allocated_blocks() {
-    return heap._get_blocks_num();
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_set_check_interval(size_t ops) {
+    _check_interval = ops;
+    _check_ops = 0;
 }
 
-size_t _num_allocated_bytes() {
-    return heap._get_all_bytes();
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_set_node(int node) {
+    _node = node;
 }
 
-size_t _num_meta_data_bytes() {
-    return heap._get_Metadata_size() * heap._get_blocks_num();
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+uintptr_t Heap<MinBlock, MaxOrder, NumBlocks>::_get_pool_start() const {
+    return _pool_start;
 }
 
-size_t _size_meta_data() {
-    return heap._get_Metadata_size();
-}
\ No newline at end of file
+// MPOL_PREFERRED: pages come from the heap's node while it has free memory
+// and from any other node after that. Only affects pages not touched yet.
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_bind(void* p, size_t bytes) const {
+    if (_node < 0) {
+        return;
+    }
+    unsigned long mask[(ARENA_MAX_NODE + 1) / (8 * sizeof(unsigned long))] = {};
+    mask[_node / (8 * sizeof(unsigned long))] |= 1ul << (_node % (8 * sizeof(unsigned long)));
+    // The kernel reads maxnode - 1 bits of the mask
+    syscall(SYS_mbind, p, bytes, MPOL_PREFERRED, mask, sizeof(mask) * 8 + 1, 0);
+}
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+bool Heap<MinBlock, MaxOrder, NumBlocks>::_set_budget(size_t soft, size_t hard) {
+    if (soft && hard && soft > hard) {
+        return false;
+    }
+    _budget_soft = soft;
+    _budget_hard = hard;
+    _over_soft = false;
+    _budget_update(); // Usage may already be over the new soft limit
+    return true;
+}
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+size_t Heap<MinBlock, MaxOrder, NumBlocks>::_get_used_bytes() const {
+    return _used_bytes;
+}
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_set_budget_callback(BudgetCallback callback, void* arg) {
+    _budget_callback = callback;
+    _budget_arg = arg;
+}
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+bool Heap<MinBlock, MaxOrder, NumBlocks>::_take_budget_event(BudgetCallback& callback, void*& arg, size_t& used) {
+    if (!_budget_event) {
+        return false;
+    }
+    _budget_event = false;
+    callback = _budget_callback;
+    arg = _budget_arg;
+    used = _budget_used();
+    return callback != nullptr;
+}
+
+// Grows an allocated buddy block to hold `size` bytes by absorbing its free
+// buddies, order by order, up to the smallest ancestor that is large enough.
+// Only the bitmap is read to decide. Absorbing a higher buddy leaves the data
+// where it is; absorbing a lower one moves the block's start down, and the
+// data is moved with it. Returns the new user pointer, or nullptr without
+// touching the block when a buddy on the way is in use or the block is not
+// a buddy block. `drop_sample` is set when a block tracked by the profiler
+// moved, so the caller can drop the old address from it.
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void* Heap<MinBlock, MaxOrder, NumBlocks>::_grow_in_place(void* oldp, size_t size, bool& drop_sample) {
+    MallocMetadata* p = _getMetaDataPtr(oldp);
+    if (!_in_pool(p)) {
+        return nullptr; // mmapped blocks have no buddies
+    }
+    uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+    int old_order = _block_orders[_unit(addr)] - 1;
+    int new_order = _get_order(size + _get_Metadata_size());
+    if (old_order < 0 || new_order > MAX_ORDER ||
+        !_budget_allows(_order_size(new_order) - _order_size(old_order))) {
+        return nullptr;
+    }
+
+    uintptr_t base = addr;
+    int order = old_order;
+    while (_order_size(order) < size + _get_Metadata_size()) {
+        if (order >= MAX_ORDER || !_buddy_is_free(base, order)) {
+            return nullptr;
+        }
+        base &= ~(uintptr_t)_order_size(order);
+        order++;
+    }
+
+    bool sampled = p->m_is_sampled;
+    _allocated_blocks[old_order].remove(p);
+    _block_orders[_unit(addr)] = 0;
+    uintptr_t curr = addr;
+    for (int i = old_order; i < order; i++) {
+        uintptr_t buddy_addr = curr ^ _order_size(i);
+        // The buddy stops being free and the block still is not, which
+        // clears the pair; the parent's pair keeps its meaning
+        _free_blocks[i].remove(reinterpret_cast<MallocMetadata*>(buddy_addr));
+        _flip_free(buddy_addr, i);
+
+        _blocks_num--;
+        _free_blocks_num--;
+        _all_bytes += _get_Metadata_size();
+        _free_blocks_bytes -= _order_size(i) - _get_Metadata_size();
+        _merges++;
+        curr &= ~(uintptr_t)_order_size(i);
+    }
+
+    MallocMetadata* merged = reinterpret_cast<MallocMetadata*>(base);
+    if (base != addr) {
+        // The ranges overlap; the free buddies' headers below are no longer needed
+        memmove((char*)merged + _get_Metadata_size(), oldp, _order_size(old_order) - _get_Metadata_size());
+        drop_sample = sampled;
+        sampled = false;
+    }
+    merged->m_size = _order_size(order);
+    merged->m_data_size = merged->m_size - _get_Metadata_size();
+    merged->m_is_free = false;
+    merged->m_is_sampled = sampled;
+    merged->m_requested_size = size;
+    merged->m_next = nullptr;
+    merged->m_prev = nullptr;
+    _block_orders[_unit(base)] = order + 1;
+    _allocated_blocks[order].push(merged);
+    _charge(_order_size(order) - _order_size(old_order));
+    _budget_update();
+
+    return (char*)merged + _get_Metadata_size();
+}
+
+typedef Heap<SMALLOC_MIN_BLOCK, SMALLOC_MAX_ORDER, SMALLOC_NUM_BLOCKS> ProcessHeap;
+
+// NUMA arenas: with several memory nodes, each node gets a heap of its own
+// whose pool and mmapped blocks are bound to it, and a thread allocates
+// from the heap of the node it runs on. Blocks go back to the heap they came
+// from, whichever thread frees them. With a single node there is one arena.
+ProcessHeap heaps[SMALLOC_MAX_ARENAS];
+static std::atomic<int> arena_count(0); // 0 until _setup_arenas() ran
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static int arena_nodes[SMALLOC_MAX_ARENAS];
+// Pool of each arena, published once it is reserved, for the unlocked
+// lookup of a block's arena
+static std::atomic<uintptr_t> arena_pools[SMALLOC_MAX_ARENAS];
+
+struct ArenaThreadState {
+    int m_arena;
+    unsigned m_countdown; // Allocations left before asking getcpu() again
+};
+static thread_local ArenaThreadState arena_state = {0, 0};
+HeapProfiler profiler;
+static thread_local SamplerState sampler_state;
+GuardedPool guarded;
+static thread_local GuardedThreadState guard_state = {1, 0};
+AllocTracer tracer;
+
+// Hands the thread's trace buffer back when the thread exits
+struct TraceThreadState {
+    TraceBuffer* m_buffer;
+    ~TraceThreadState() { tracer._release(m_buffer); }
+};
+static thread_local TraceThreadState trace_state;
+
+static void _heap_prefork() {
+    for (int i = 0; i < SMALLOC_MAX_ARENAS; i++) {
+        heaps[i]._prefork();
+    }
+    profiler._prefork();
+    guarded._prefork();
+}
+
+static void _heap_postfork_parent() {
+    guarded._postfork_parent();
+    profiler._postfork_parent();
+    for (int i = SMALLOC_MAX_ARENAS - 1; i >= 0; i--) {
+        heaps[i]._postfork_parent();
+    }
+}
+
+static void _heap_postfork_child() {
+    guarded._postfork_child();
+    profiler._postfork_child();
+    for (int i = 0; i < SMALLOC_MAX_ARENAS; i++) {
+        heaps[i]._postfork_child();
+    }
+}
+
+// Online memory nodes from sysfs ("0-1", "0,2-3"), the first `max` of them
+// into `nodes`. Read with plain syscalls: the heap is not usable yet.
+static int _read_online_nodes(int* nodes, int max) {
+    char buf[256];
+    int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = '\0';
+
+    int count = 0;
+    for (char* cur = buf; *cur >= '0' && *cur <= '9';) {
+        int first = (int)strtol(cur, &cur, 10);
+        int last = *cur == '-' ? (int)strtol(cur + 1, &cur, 10) : first;
+        for (int node = first; node <= last && node <= ARENA_MAX_NODE && count < max; node++) {
+            nodes[count++] = node;
+        }
+        if (*cur == ',') {
+            cur++;
+        }
+    }
+    return count;
+}
+
+static void _setup_arenas() {
+    pthread_atfork(_heap_prefork, _heap_postfork_parent, _heap_postfork_child);
+    int count = _read_online_nodes(arena_nodes, SMALLOC_MAX_ARENAS);
+    if (count > 1) {
+        for (int i = 0; i < count; i++) {
+            heaps[i]._set_node(arena_nodes[i]);
+        }
+    } else {
+        count = 1;
+    }
+    arena_count.store(count, std::memory_order_release);
+}
+
+static int _arena_count() {
+    int count = arena_count.load(std::memory_order_acquire);
+    if (__builtin_expect(count == 0, 0)) {
+        pthread_once(&arena_once, _setup_arenas);
+        count = arena_count.load(std::memory_order_acquire);
+    }
+    return count;
+}
+
+// Arena of the node the thread runs on, looked up again every
+// ARENA_NODE_REFRESH allocations since threads rarely change nodes
+static int _local_arena() {
+    int count = _arena_count();
+    if (count == 1) {
+        return 0;
+    }
+    if (arena_state.m_countdown-- == 0) {
+        unsigned cpu;
+        unsigned node;
+        int arena = 0;
+        if (getcpu(&cpu, &node) == 0) {
+            arena = (int)(node % count);
+            for (int i = 0; i < count; i++) {
+                if (arena_nodes[i] == (int)node) {
+                    arena = i;
+                }
+            }
+        }
+        arena_state.m_arena = arena;
+        arena_state.m_countdown = ARENA_NODE_REFRESH - 1;
+    }
+    return arena_state.m_arena;
+}
+
+// Holds a heap's lock for the lifetime of the scope
+class HeapGuard {
+public:
+    explicit HeapGuard(ProcessHeap& heap) : _heap(heap) { _heap._lock_heap(); }
+    ~HeapGuard() { _heap._unlock_heap(); }
+    HeapGuard(const HeapGuard&) = delete;
+    HeapGuard& operator=(const HeapGuard&) = delete;
+
+private:
+    ProcessHeap& _heap;
+};
+
+// Heap a block belongs to. Pool blocks are found from the published pool
+// ranges without a lock; mmapped blocks are looked up in each heap's page
+// map. Foreign pointers go to the first heap, which ignores them.
+static ProcessHeap& _heap_of(const void* p) {
+    int count = _arena_count();
+    if (count == 1) {
+        return heaps[0];
+    }
+    uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+    for (int i = 0; i < count; i++) {
+        uintptr_t start = arena_pools[i].load(std::memory_order_acquire);
+        if (start && addr - start < ProcessHeap::MAX_BLOCK_SIZE * ProcessHeap::RESERVED_BLOCKS) {
+            return heaps[i];
+        }
+    }
+    for (int i = 1; i < count; i++) {
+        HeapGuard guard(heaps[i]);
+        if (heaps[i]._owns(p)) {
+            return heaps[i];
+        }
+    }
+    return heaps[0];
+}
+
+// Slow path of the guard-page sampling: draws the next gap and tries the
+// guarded pool, which turns the request down if it is full or the block
+// would not fit on a page
+__attribute__((noinline)) static void* _guarded_alloc(size_t size) {
+    guard_state.m_countdown = guarded._next_countdown(guard_state);
+    return guarded._get_rate() ? guarded._allocate(size) : nullptr;
+}
+
+// Slow path of the profiler hook, kept out of line so smalloc stays small
+__attribute__((noinline)) static void _sample_allocation(ProcessHeap& heap, void* p, size_t size) {
+    if (!profiler._should_sample(sampler_state, size)) {
+        return;
+    }
+    if (profiler._record(p, size)) {
+        heap._set_sampled(p);
+    }
+}
+
+// A budget event taken under the heap lock, run once it is released
+struct BudgetEvent {
+    bool m_pending = false;
+    BudgetCallback m_callback;
+    void* m_arg;
+    size_t m_used;
+};
+
+static thread_local bool in_budget_callback = false;
+
+// The callback may free (or allocate) memory; a budget event raised from
+// inside it is dropped rather than running it again on the same thread
+__attribute__((noinline)) static void _run_budget_callback(const BudgetEvent& event) {
+    if (in_budget_callback) {
+        return;
+    }
+    in_budget_callback = true;
+    event.m_callback(event.m_used, event.m_arg);
+    in_budget_callback = false;
+}
+
+// Untraced allocation path shared by the public entry points. With `usable`
+// it also returns the block's usable size, taken under the same lock.
+static void* _smalloc(size_t size, StatCall call, size_t* usable = nullptr){
+    if (size <= 0 || size > MAX_MEM)
+    {
+        return nullptr;
+    }
+    if (__builtin_expect(--guard_state.m_countdown == 0, 0))
+    {
+        void *res = _guarded_alloc(size);
+        if (res)
+        {
+            if (usable)
+            {
+                *usable = size;
+            }
+            return res;
+        }
+    }
+    int arena = _local_arena();
+    ProcessHeap& heap = heaps[arena];
+    void *res;
+    BudgetEvent event;
+    {
+        HeapGuard guard(heap);
+        heap._init();
+        if (!arena_pools[arena].load(std::memory_order_relaxed))
+        {
+            arena_pools[arena].store(heap._get_pool_start(), std::memory_order_release);
+        }
+        heap._count_call(call);
+        void *ptr = heap._alloc_block(size);
+        res = (!ptr) ? nullptr : (char *)ptr + heap._get_Metadata_size();
+        if (usable) {
+            *usable = res ? heap._get_block_size(res) : 0;
+        }
+        event.m_pending = heap._take_budget_event(event.m_callback, event.m_arg, event.m_used);
+    }
+    if (event.m_pending)
+    {
+        _run_budget_callback(event);
+    }
+
+    if (profiler._enabled() && res)
+    {
+        _sample_allocation(heap, res, size);
+    }
+    return res;
+
+}
+
+static void _sfree(void *ptr, StatCall call)
+{
+    if (ptr == nullptr)
+    {
+        return;
+    }
+    if (guarded._owns(ptr))
+    {
+        guarded._deallocate(ptr);
+        return;
+    }
+    ProcessHeap& heap = _heap_of(ptr);
+    HeapGuard guard(heap);
+    heap._count_call(call);
+    if (heap._free_block(ptr))
+    {
+        // Under the heap lock, so the address cannot be handed out again first
+        profiler._remove(ptr);
+    }
+}
+
+static void _sfree_sized(void *ptr, size_t size, StatCall call)
+{
+    if (ptr == nullptr)
+    {
+        return;
+    }
+    if (guarded._owns(ptr))
+    {
+        guarded._deallocate(ptr);
+        return;
+    }
+    ProcessHeap& heap = _heap_of(ptr);
+    HeapGuard guard(heap);
+    heap._count_call(call);
+    if (heap._free_block_sized(ptr, size))
+    {
+        profiler._remove(ptr);
+    }
+}
+
+void* smalloc(size_t size){
+    HEAP_LATENCY(PROBE_SMALLOC);
+    void *res = _smalloc(size, STAT_SMALLOC);
+    if (tracer._enabled())
+    {
+        tracer._record(trace_state.m_buffer, TRACE_SMALLOC, res, size, 0);
+    }
+    return res;
+}
+
+// The block is a power of two (or a superblock) and the rest of it is
+// usable, so growing callers can skip reallocations up to *actual
+void* smalloc_at_least(size_t size, size_t* actual){
+    HEAP_LATENCY(PROBE_SMALLOC);
+    size_t usable = 0;
+    void *res = _smalloc(size, STAT_SMALLOC, &usable);
+    if (tracer._enabled())
+    {
+        tracer._record(trace_state.m_buffer, TRACE_SMALLOC, res, size, 0);
+    }
+    if (actual)
+    {
+        *actual = usable;
+    }
+    return res;
+}
+
+void *scalloc(size_t num, size_t size)
+{
+    HEAP_LATENCY(PROBE_SCALLOC);
+    if (size && num > SIZE_MAX / size)
+    {
+        return nullptr; // num * size overflows
+    }
+    void *res = _smalloc(num * size, STAT_SCALLOC);
+    if (tracer._enabled())
+    {
+        tracer._record(trace_state.m_buffer, TRACE_SCALLOC, res, size, num);
+    }
+
+    if (res == nullptr)
+    {
+        return nullptr;
+    }
+
+    memset(res, 0, num * size);
+
+    return res;
+}
+
+void sfree(void *ptr)
+{
+    HEAP_LATENCY(PROBE_SFREE);
+    // Recorded before the block is released, so no other thread can be seen
+    // reusing the address ahead of this free
+    if (tracer._enabled() && ptr)
+    {
+        tracer._record(trace_state.m_buffer, TRACE_SFREE, ptr, 0, 0);
+    }
+    _sfree(ptr, STAT_SFREE);
+}
+
+// `size` should be the size the block was allocated with (num * size for
+// scalloc, the last size passed to srealloc); another size costs the usual
+// lookup but frees the block correctly
+void sfree_sized(void *ptr, size_t size)
+{
+    HEAP_LATENCY(PROBE_SFREE);
+    if (tracer._enabled() && ptr)
+    {
+        tracer._record(trace_state.m_buffer, TRACE_SFREE, ptr, 0, 0);
+    }
+    _sfree_sized(ptr, size, STAT_SFREE);
+}
+
+// Stamps the trace record of an srealloc that moves the block, after the
+// new block is taken and before the old one is freed. Stamped any later, a
+// thread that gets the old address next could be traced ahead of this call;
+// stamped earlier, one that freed the new address could be traced after it.
+// Other outcomes are traced when srealloc returns, like smalloc.
+static void _stamp_srealloc(uint64_t &stamp)
+{
+    if (tracer._enabled())
+    {
+        stamp = tracer._timestamp();
+    }
+}
+
+// A moved block is traced while both blocks are held: see _stamp_srealloc
+static void *_srealloc(void *oldp, size_t size, uint64_t &stamp)
+{
+
+    if (size <= 0 || size > MAX_MEM)
+    {
+        return nullptr;
+    }
+
+    if (oldp == nullptr)
+    {
+        return _smalloc(size, STAT_SREALLOC);
+    }
+
+    size_t old_size;
+    if (guarded._owns(oldp))
+    {
+        // Never grown in place. A block freed earlier has size 0 here and
+        // is reported as a double free by the _sfree below.
+        old_size = guarded._size(oldp);
+        if (old_size >= size)
+        {
+            return oldp;
+        }
+        void *res = _smalloc(size, STAT_NONE);
+        if (res == nullptr)
+        {
+            return nullptr;
+        }
+        memcpy(res, oldp, old_size);
+        _stamp_srealloc(stamp);
+        _sfree(oldp, STAT_NONE);
+        return res;
+    }
+    ProcessHeap& heap = _heap_of(oldp);
+    void *res;
+    BudgetEvent event;
+    {
+        HeapGuard guard(heap);
+        heap._count_call(STAT_SREALLOC);
+        old_size = heap._get_block_size(oldp);
+        if (old_size == (size_t)-1)
+        {
+            return nullptr; // Not a block of this heap
+        }
+        if (old_size >= size)
+        {
+            heap._set_requested_size(oldp, size);
+            return oldp;
+        }
+        bool drop_sample = false;
+        res = heap._grow_in_place(oldp, size, drop_sample);
+        if (drop_sample)
+        {
+            profiler._remove(oldp);
+        }
+        event.m_pending = heap._take_budget_event(event.m_callback, event.m_arg, event.m_used);
+    }
+    if (event.m_pending)
+    {
+        _run_budget_callback(event);
+    }
+    if (res)
+    {
+        return res;
+    }
+
+    // The old block stays valid until its data is copied, and stays
+    // allocated if there is no new block
+    res = _smalloc(size, STAT_NONE);
+    if (res == nullptr)
+    {
+        return nullptr;
+    }
+    memcpy(res, oldp, old_size); // old_size < size
+    _stamp_srealloc(stamp);
+    _sfree(oldp, STAT_NONE);
+
+    return res;
+}
+
+void *srealloc(void *oldp, size_t size)
+{
+    HEAP_LATENCY(PROBE_SREALLOC);
+    uint64_t stamp = TRACE_NOW;
+    void *res = _srealloc(oldp, size, stamp);
+    if (tracer._enabled())
+    {
+        tracer._record_at(trace_state.m_buffer, stamp, TRACE_SREALLOC, res, size,
+                          reinterpret_cast<uint64_t>(oldp));
+    }
+    return res;
+}
+
+// A region hands out memory by bumping a pointer through max-order buddy
+// blocks (128 KB by default) and gives it all back at once. Objects too big
+// to share a chunk get a block of their own. A region is not thread-safe; the
+// heap calls it makes are locked as usual.
+//
+// Objects are aligned like smalloc's, for any fundamental type. The chunk
+// and large-object header is padded to that alignment, so bumping starts
+// aligned right after it, and sizes are rounded up to it.
+#define REGION_ALIGNMENT alignof(max_align_t)
+
+struct alignas(REGION_ALIGNMENT) RegionChunk {
+    RegionChunk* m_next;
+};
+
+struct Region {
+    RegionChunk* m_chunks; // Head is the chunk being bumped through
+    RegionChunk* m_large;  // Dedicated blocks for large objects
+    char* m_cur;
+    char* m_end;
+    size_t m_bytes;        // Taken from the heap for chunks and large objects
+    size_t m_limit;        // Bound on m_bytes, 0 for none
+};
+
+#define REGION_CHUNK_BYTES (ProcessHeap::MAX_BLOCK_SIZE - sizeof(MallocMetadata)) // One max-order block
+#define REGION_LARGE_OBJECT (REGION_CHUNK_BYTES / 4)
+
+static bool _region_within_limit(const Region* region, size_t bytes) {
+    return !region->m_limit || region->m_bytes + bytes <= region->m_limit;
+}
+
+static bool _region_add_chunk(Region* region) {
+    if (!_region_within_limit(region, REGION_CHUNK_BYTES)) {
+        return false;
+    }
+    RegionChunk* chunk = (RegionChunk*)_smalloc(REGION_CHUNK_BYTES, STAT_NONE);
+    if (!chunk) {
+        return false;
+    }
+    chunk->m_next = region->m_chunks;
+    region->m_chunks = chunk;
+    region->m_cur = (char*)(chunk + 1);
+    region->m_end = (char*)chunk + REGION_CHUNK_BYTES;
+    region->m_bytes += REGION_CHUNK_BYTES;
+    return true;
+}
+
+Region* region_create() {
+    Region* region = (Region*)_smalloc(sizeof(Region), STAT_NONE);
+    if (!region) {
+        return nullptr;
+    }
+    region->m_chunks = nullptr;
+    region->m_large = nullptr;
+    region->m_cur = nullptr;
+    region->m_end = nullptr;
+    region->m_bytes = 0;
+    region->m_limit = 0;
+    return region;
+}
+
+// Later allocations fail rather than take the region past `bytes`; memory
+// it already holds is kept
+void region_set_limit(Region* region, size_t bytes) {
+    region->m_limit = bytes;
+}
+
+void* region_alloc(Region* region, size_t size) {
+    if (size <= 0 || size > MAX_MEM) {
+        return nullptr;
+    }
+    size = (size + REGION_ALIGNMENT - 1) & ~(size_t)(REGION_ALIGNMENT - 1);
+    if ((size_t)(region->m_end - region->m_cur) >= size) {
+        void* p = region->m_cur;
+        region->m_cur += size;
+        return p;
+    }
+    if (size >= REGION_LARGE_OBJECT) {
+        if (!_region_within_limit(region, sizeof(RegionChunk) + size)) {
+            return nullptr;
+        }
+        RegionChunk* block = (RegionChunk*)_smalloc(sizeof(RegionChunk) + size, STAT_NONE);
+        if (!block) {
+            return nullptr;
+        }
+        block->m_next = region->m_large;
+        region->m_large = block;
+        region->m_bytes += sizeof(RegionChunk) + size;
+        return block + 1;
+    }
+    if (!_region_add_chunk(region)) {
+        return nullptr;
+    }
+    void* p = region->m_cur;
+    region->m_cur += size;
+    return p;
+}
+
+// Keeps one chunk so the next round of allocations does not go back to the heap
+void region_reset(Region* region) {
+    while (region->m_large) {
+        RegionChunk* next = region->m_large->m_next;
+        _sfree(region->m_large, STAT_NONE);
+        region->m_large = next;
+    }
+    RegionChunk* keep = region->m_chunks;
+    region->m_bytes = keep ? REGION_CHUNK_BYTES : 0;
+    if (!keep) {
+        return;
+    }
+    while (keep->m_next) {
+        RegionChunk* next = keep->m_next->m_next;
+        _sfree(keep->m_next, STAT_NONE);
+        keep->m_next = next;
+    }
+    region->m_cur = (char*)(keep + 1);
+    region->m_end = (char*)keep + REGION_CHUNK_BYTES;
+}
+
+void region_destroy(Region* region) {
+    if (!region) {
+        return;
+    }
+    region_reset(region);
+    _sfree(region->m_chunks, STAT_NONE);
+    _sfree(region, STAT_NONE);
+}
+
+// 0 for pointers the heap did not hand out
+size_t smalloc_usable_size(void* p) {
+    if (!p) {
+        return 0;
+    }
+    if (guarded._owns(p)) {
+        return guarded._size(p);
+    }
+    ProcessHeap& heap = _heap_of(p);
+    HeapGuard guard(heap);
+    size_t size = heap._get_block_size(p);
+    return size == (size_t)-1 ? 0 : size;
+}
+
+// A counter summed over the arenas, each read under its own lock
+static size_t _sum_arenas(size_t (ProcessHeap::*counter)() const) {
+    size_t total = 0;
+    for (int i = 0; i < _arena_count(); i++) {
+        HeapGuard guard(heaps[i]);
+        total += (heaps[i].*counter)();
+    }
+    return total;
+}
+
+size_t _num_free_blocks() {
+    return _sum_arenas(&ProcessHeap::_get_free_blocks_num);
+}
+
+size_t _num_free_bytes() {
+    return _sum_arenas(&ProcessHeap::_get_free_blocks_bytes);
+}
+
+size_t _num_allocated_blocks() {
+    return _sum_arenas(&ProcessHeap::_get_blocks_num);
+}
+
+size_t _num_allocated_bytes() {
+    return _sum_arenas(&ProcessHeap::_get_all_bytes);
+}
+
+size_t _num_meta_data_bytes() {
+    return _size_meta_data() * _num_allocated_blocks();
+}
+
+size_t _size_meta_data() {
+    return heaps[0]._get_Metadata_size();
+}
+
+bool smalloc_owns(const void* p) {
+    if (guarded._owns(p)) {
+        return guarded._size(p) != 0;
+    }
+    ProcessHeap& heap = _heap_of(p);
+    HeapGuard guard(heap);
+    return heap._owns(p);
+}
+
+void smalloc_profile_set_rate(size_t bytes) {
+    profiler._set_sample_rate(bytes);
+}
+
+size_t smalloc_profile_get_rate() {
+    return profiler._get_sample_rate();
+}
+
+bool smalloc_profile_dump(const char* path) {
+    return profiler._dump(path);
+}
+
+// The limits hold for the process, whichever arenas the memory is in
+bool smalloc_budget_set(size_t soft_bytes, size_t hard_bytes) {
+    if (soft_bytes && hard_bytes && soft_bytes > hard_bytes) {
+        return false;
+    }
+    process_budget.m_soft.store(soft_bytes, std::memory_order_relaxed);
+    process_budget.m_hard.store(hard_bytes, std::memory_order_relaxed);
+    process_budget.m_over_soft.store(false, std::memory_order_relaxed);
+    // Usage may already be over the new soft limit
+    ProcessHeap& heap = heaps[_local_arena()];
+    HeapGuard guard(heap);
+    heap._budget_update();
+    return true;
+}
+
+void smalloc_budget_set_callback(BudgetCallback callback, void* arg) {
+    for (int i = 0; i < SMALLOC_MAX_ARENAS; i++) {
+        HeapGuard guard(heaps[i]);
+        heaps[i]._set_budget_callback(callback, arg);
+    }
+}
+
+size_t smalloc_budget_used() {
+    return _budget_used();
+}
+
+int smalloc_arena_count() {
+    return _arena_count();
+}
+
+// The limits hold for one arena, next to the process-wide ones
+bool smalloc_budget_set_arena(int arena, size_t soft_bytes, size_t hard_bytes) {
+    if (arena < 0 || arena >= _arena_count()) {
+        return false;
+    }
+    HeapGuard guard(heaps[arena]);
+    return heaps[arena]._set_budget(soft_bytes, hard_bytes);
+}
+
+// 0 for an arena that does not exist
+size_t smalloc_budget_arena_used(int arena) {
+    if (arena < 0 || arena >= _arena_count()) {
+        return 0;
+    }
+    HeapGuard guard(heaps[arena]);
+    return heaps[arena]._get_used_bytes();
+}
+
+bool smalloc_guard_set_rate(size_t calls) {
+    return guarded._set_rate(calls);
+}
+
+size_t smalloc_guard_get_rate() {
+    return guarded._get_rate();
+}
+
+bool smalloc_trace_start(const char* path) {
+    return tracer._start(path);
+}
+
+void smalloc_trace_stop() {
+    tracer._stop();
+}
+
+// Summed over the arenas
+void smalloc_stats(HeapStats* stats) {
+    {
+        HeapGuard guard(heaps[0]);
+        heaps[0]._get_stats(*stats);
+    }
+    for (int i = 1; i < _arena_count(); i++) {
+        HeapStats arena;
+        {
+            HeapGuard guard(heaps[i]);
+            heaps[i]._get_stats(arena);
+        }
+        heap_stats_merge(*stats, arena);
+    }
+}
+
+bool smalloc_heap_check() {
+    for (int i = 0; i < _arena_count(); i++) {
+        HeapGuard guard(heaps[i]);
+        if (!heaps[i]._check_heap()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void smalloc_heap_check_every(size_t ops) {
+    for (int i = 0; i < SMALLOC_MAX_ARENAS; i++) {
+        HeapGuard guard(heaps[i]);
+        heaps[i]._set_check_interval(ops);
+    }
+}
+
+bool smalloc_stats_dump_json(const char* path) {
+    HeapStats stats;
+    smalloc_stats(&stats);
+    return heap_stats_dump_json(stats, path);
+}
+
+#ifdef SMALLOC_INSTRUMENT
+bool smalloc_latency_dump(const char* path) {
+    return latency._dump(path);
+}
+
+void smalloc_latency_reset() {
+    latency._reset();
+}
+#endif
+
+SMALLOC_END_NAMESPACE
+
+#ifdef SMALLOC_OVERRIDE_NEW
+// Global new/delete on top of this heap. Sized deallocation (on by default
+// since C++14) gives operator delete the object size, which goes straight to
+// sfree_sized.
+void* operator new(size_t size) {
+    void* p = smalloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return smalloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return smalloc(size ? size : 1);
+}
+
+void operator delete(void* p) noexcept {
+    sfree(p);
+}
+
+void operator delete[](void* p) noexcept {
+    sfree(p);
+}
+
+void operator delete(void* p, size_t size) noexcept {
+    sfree_sized(p, size ? size : 1);
+}
+
+void operator delete[](void* p, size_t size) noexcept {
+    sfree_sized(p, size ? size : 1);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    sfree(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    sfree(p);
+}
+#endif
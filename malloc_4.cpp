@@ -1,17 +1,28 @@
 #include <unistd.h>
+#include <stdint.h>
 #include <string.h>
-#include <cmath>
 #include <sys/mman.h>
-#include <iostream>
+#include <pthread.h>
+#include "heap_geometry.h"
+#include "heap_stats.h"
+#include "reserved_range.h"
+#include "smalloc.h"
 
 
 #define MAX_MEM 100000000
-#define MAX_ORDER 10
-#define MAX_BLOCK_SIZE (128 * 1024)
-#define NUM_BLOCKS 32
+
+// Configuration of the process heap (geometry in heap_geometry.h); see Heap
+// for the constraints
+#ifndef SMALLOC_MMAP_THRESHOLD_MAX
+#define SMALLOC_MMAP_THRESHOLD_MAX HUGEPAGE_THRESHOLD_SMALLOC // Bound of the adaptive mmap threshold
+#endif
+#define MMAP_CACHE_FACTOR 2 // Cached superblocks may hold this many thresholds of bytes
+#define MMAP_PAGE_SIZE 4096 // Other mmapped blocks are rounded to whole pages
 #define HUGEPAGE_THRESHOLD_SMALLOC (4 * 1024 * 1024) // 4MB
 #define HUGEPAGE_THRESHOLD_SCALLOC (2 * 1024 * 1024) // 2MB
 
+SMALLOC_BEGIN_NAMESPACE
+
 
 
 struct MallocMetadata {
@@ -19,6 +30,7 @@ struct MallocMetadata {
     size_t m_size;
     bool m_is_free;
     bool m_is_hugepage; // New field for HugePage tracking
+    uint32_t m_requested_size; // What the user asked for (fits in the padding, sizes are capped by MAX_MEM)
     MallocMetadata *m_next;
     MallocMetadata *m_prev;
 };
@@ -34,6 +46,9 @@ struct list {
 };
 
 void list::insert(MallocMetadata *m) {
+    // The block comes from another list or a split, so its links are stale
+    m->m_next = nullptr;
+    m->m_prev = nullptr;
     if (m_size == 0) {
         m_head = m;
         m_tail = m;
@@ -88,7 +103,39 @@ void list::remove(MallocMetadata *m) {
 
 }
 
+// Buddy heap over NumBlocks blocks of MinBlock << MaxOrder bytes. Orders
+// and block sizes are derived at compile time, and each instantiation is an
+// independent heap with its own lists, counters and lock.
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
 class Heap {
+public:
+    static constexpr size_t MIN_BLOCK_SIZE = MinBlock;
+    static constexpr int MAX_ORDER = MaxOrder;
+    static constexpr size_t MAX_BLOCK_SIZE = MinBlock << MaxOrder;
+    static constexpr size_t NUM_BLOCKS = NumBlocks;
+    static constexpr size_t RESERVED_BLOCKS = NumBlocks * SMALLOC_POOL_RESERVE;
+
+    // Block size of an order, header included
+    static constexpr size_t _order_size(int order) {
+        return MinBlock << order;
+    }
+
+    // Smallest order whose blocks hold `size` bytes, header included
+    static constexpr int _get_order(size_t size) {
+        return size <= MinBlock ? 0 : 64 - __builtin_clzll((size - 1) / MinBlock);
+    }
+
+    static_assert(MinBlock && (MinBlock & (MinBlock - 1)) == 0, "MinBlock must be a power of two");
+    static_assert(MinBlock > sizeof(MallocMetadata), "MinBlock must leave room after the block header");
+    static_assert(MaxOrder >= 0 && MaxOrder < STATS_MAX_ORDERS, "MaxOrder out of range");
+    static_assert(NumBlocks && (NumBlocks & (NumBlocks - 1)) == 0,
+                  "NumBlocks must be a power of two, the pool is aligned to its own size");
+    static_assert(SMALLOC_POOL_RESERVE > 0 && (SMALLOC_POOL_RESERVE & (SMALLOC_POOL_RESERVE - 1)) == 0,
+                  "SMALLOC_POOL_RESERVE must be a power of two");
+    static_assert(_get_order(MinBlock) == 0 && _get_order(MAX_BLOCK_SIZE) == MaxOrder &&
+                  _get_order(MAX_BLOCK_SIZE + 1) == MaxOrder + 1, "order table is inconsistent");
+    static_assert(_get_order(SMALLOC_MMAP_THRESHOLD_MAX) < STATS_MAX_ORDERS, "SMALLOC_MMAP_THRESHOLD_MAX too large");
+
 private:
     size_t _blocks_num;
     size_t _free_blocks_num;
@@ -100,12 +147,49 @@ private:
     list _allocated_blocks[MAX_ORDER + 1];
     list _free_blocks[MAX_ORDER + 1];
     bool _is_first_time;
+    pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+
+    // Cumulative counters reported by _get_stats()
+    size_t _mmap_blocks_num;
+    size_t _mmap_bytes;
+    size_t _hugepage_blocks_num;
+    size_t _hugepage_bytes;
+    size_t _calls[STAT_CALL_KINDS];
+    size_t _splits;
+    size_t _merges;
+    size_t _mmap_calls;
+    size_t _munmap_calls;
+
+    // Adaptive mmap threshold: blocks above MAX_BLOCK_SIZE and up to
+    // _mmap_threshold (header included) are power-of-two superblocks, which
+    // are cached by order when freed instead of unmapped. HugePage blocks are
+    // never cached.
+    size_t _mmap_threshold;
+    list _cached_blocks[STATS_MAX_ORDERS];
+    size_t _cached_bytes;
+    size_t _threshold_raises;
+    size_t _cache_hits;
+
+    // RESERVED_BLOCKS max-order blocks of address space are reserved for the
+    // pool, aligned to their size, and committed one after the other as the
+    // free lists run dry
+    ReservedRange _pool;
+
+    bool _grow_pool();
+
+    MallocMetadata *_alloc_large(size_t size, int order, int map_flags, bool *fresh);
+
+    void _release_large(MallocMetadata *block, int order, size_t block_size);
 
 public:
     void _init();
 
     Heap() : _blocks_num(0), _free_blocks_num(0), _free_blocks_bytes(0),
-             _diff(0), _all_bytes(0), _is_first_time(true) {}
+             _diff(0), _all_bytes(0), _is_first_time(true),
+             _mmap_blocks_num(0), _mmap_bytes(0), _hugepage_blocks_num(0),
+             _hugepage_bytes(0), _calls(), _splits(0), _merges(0),
+             _mmap_calls(0), _munmap_calls(0), _mmap_threshold(MAX_BLOCK_SIZE),
+             _cached_blocks(), _cached_bytes(0), _threshold_raises(0), _cache_hits(0) {}
 
     size_t _get_blocks_num() const;
 
@@ -128,106 +212,161 @@ public:
 
     void _div_buddies(int order);
 
-    bool _check_merge(void *oldp, size_t size);
-
-    void _merge_blocks_if_needed(void *oldp, size_t size);
+    void *_grow_in_place(void *oldp, size_t size);
 
 
-    void *_alloc_block(size_t size);
+    // `map_flags` are added to the mmap flags of a block mapped for this
+    // call; *fresh is set when the block is such a new mapping, whose data
+    // the kernel has zeroed
+    void *_alloc_block(size_t size, int map_flags = 0, bool *fresh = nullptr);
 
     void _free_block(void *p);
 
     void _merge_buddies(size_t order);
 
+    void _set_requested_size(void *p, size_t size);
 
+    void _count_call(StatCall call);
+
+    void _get_stats(HeapStats &stats) const;
+
+    // Every public entry point holds the heap lock while touching the lists
+    void _lock_heap();
+
+    void _unlock_heap();
+
+    // pthread_atfork handlers: keep the heap quiescent across fork()
+    void _prefork();
+
+    void _postfork_parent();
+
+    void _postfork_child();
 };
 
 
-MallocMetadata *Heap::_getMetaDataPtr(void *ptr) const {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+constexpr size_t Heap<MinBlock, MaxOrder, NumBlocks>::MIN_BLOCK_SIZE;
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+constexpr int Heap<MinBlock, MaxOrder, NumBlocks>::MAX_ORDER;
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+constexpr size_t Heap<MinBlock, MaxOrder, NumBlocks>::MAX_BLOCK_SIZE;
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+constexpr size_t Heap<MinBlock, MaxOrder, NumBlocks>::NUM_BLOCKS;
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+constexpr size_t Heap<MinBlock, MaxOrder, NumBlocks>::RESERVED_BLOCKS;
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+MallocMetadata *Heap<MinBlock, MaxOrder, NumBlocks>::_getMetaDataPtr(void *ptr) const {
     if (!ptr) {
         return nullptr;
     }
     return (MallocMetadata *) ((char *) ptr - sizeof(MallocMetadata));
 }
 
-size_t Heap::_get_all_bytes() const {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+size_t Heap<MinBlock, MaxOrder, NumBlocks>::_get_all_bytes() const {
     return _all_bytes;
 }
 
-void Heap::_init() {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_lock_heap() {
+    pthread_mutex_lock(&_lock);
+}
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_unlock_heap() {
+    pthread_mutex_unlock(&_lock);
+}
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_prefork() {
+    // No allocation can be half way through its list updates once we hold the lock
+    _lock_heap();
+}
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_postfork_parent() {
+    _unlock_heap();
+}
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_postfork_child() {
+    // The thread that held the lock does not exist in the child, so the lists
+    // are consistent (we took the lock in _prefork) but the mutex must be rebuilt
+    pthread_mutex_init(&_lock, nullptr);
+}
+
+static void _heap_prefork();
+
+static void _heap_postfork_parent();
+
+static void _heap_postfork_child();
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_init() {
     if (!_is_first_time) {
         return;
     }
     _is_first_time = false;
 
-    // Get the current program break
-    void *heap_break = sbrk(0);
-    size_t chunk_size = MAX_BLOCK_SIZE * NUM_BLOCKS; // 32 * 128 KB = 4 MB
-    intptr_t break_address = (intptr_t) (heap_break);
-
-    // Align the program break to the next multiple of chunk_size (4 MB)
-    intptr_t alignment = (break_address + chunk_size - 1) & ~(chunk_size - 1);
-    size_t alignment_offset = alignment - break_address;
+    pthread_atfork(_heap_prefork, _heap_postfork_parent, _heap_postfork_child);
 
-    // Adjust the program break to ensure alignment and allocate memory
-    void *newPtr = sbrk(chunk_size + alignment_offset);
-    if (!newPtr) {
+    size_t reserved = MAX_BLOCK_SIZE * RESERVED_BLOCKS; // 2048 * 128 KB = 256 MB by default
+    if (!_pool._reserve(reserved, reserved)) {
         return;
     }
 
-    // Adjust newPtr to the aligned starting address
-    newPtr = (char *) newPtr + alignment_offset;
-
     // Initialize free and allocated block lists
     for (int i = 0; i <= MAX_ORDER; i++) {
         _free_blocks[i] = {nullptr, nullptr, 0};
         _allocated_blocks[i] = {nullptr, nullptr, 0};
     }
+}
 
-    // Initialize metadata for the 32 blocks and add them to the free list of MAX_ORDER
-    for (int i = 0; i < NUM_BLOCKS; i++) {
-        void *blockStart = (char *) newPtr + i * MAX_BLOCK_SIZE;
-        MallocMetadata *newMeta = reinterpret_cast<MallocMetadata *>(blockStart);
-
-        // Initialize metadata for each block
-        newMeta->m_is_free = true;
-        newMeta->m_is_hugepage = false;
-        newMeta->m_data_size = MAX_BLOCK_SIZE - _get_Metadata_size(); // Usable size
-        newMeta->m_size = MAX_BLOCK_SIZE;                              // Total size
-        newMeta->m_next = nullptr;
-        newMeta->m_prev = nullptr;
-
-        // Insert block into the free list of MAX_ORDER
-        _free_blocks[MAX_ORDER].insert(newMeta);
+// Commits the next max-order block of the reserved pool and puts it on the
+// free list of MAX_ORDER; false once the whole pool is committed
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+bool Heap<MinBlock, MaxOrder, NumBlocks>::_grow_pool() {
+    MallocMetadata *newMeta = reinterpret_cast<MallocMetadata *>(_pool._extend(MAX_BLOCK_SIZE));
+    if (!newMeta) {
+        return false;
     }
+    newMeta->m_is_free = true;
+    newMeta->m_is_hugepage = false;
+    newMeta->m_data_size = MAX_BLOCK_SIZE - _get_Metadata_size(); // Usable size
+    newMeta->m_size = MAX_BLOCK_SIZE;                              // Total size
+    _free_blocks[MAX_ORDER].insert(newMeta);
 
-    // Update heap statistics
-    _free_blocks_num = NUM_BLOCKS;
-    _free_blocks_bytes =
-            MAX_BLOCK_SIZE * NUM_BLOCKS - _get_Metadata_size() * NUM_BLOCKS;
-    _all_bytes = _free_blocks_bytes;
-    _blocks_num = NUM_BLOCKS;
-
+    _free_blocks_num++;
+    _free_blocks_bytes += newMeta->m_data_size;
+    _all_bytes += newMeta->m_data_size;
+    _blocks_num++;
+    return true;
 }
 
 
-size_t Heap::_get_blocks_num() const {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+size_t Heap<MinBlock, MaxOrder, NumBlocks>::_get_blocks_num() const {
     return _blocks_num;
 }
 
-size_t Heap::_get_free_blocks_num() const {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+size_t Heap<MinBlock, MaxOrder, NumBlocks>::_get_free_blocks_num() const {
     return _free_blocks_num;
 }
 
-size_t Heap::_get_free_blocks_bytes() const {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+size_t Heap<MinBlock, MaxOrder, NumBlocks>::_get_free_blocks_bytes() const {
     return _free_blocks_bytes;
 }
 
-size_t Heap::_get_Metadata_size() const {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+size_t Heap<MinBlock, MaxOrder, NumBlocks>::_get_Metadata_size() const {
     return sizeof(MallocMetadata);
 }
 
-void Heap::_div_buddies(int order) {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_div_buddies(int order) {
     int free_order = -1;
     for (int i = order + 1; i <= MAX_ORDER; i++) {
         if (_free_blocks[i].m_size > 0) {
@@ -263,16 +402,20 @@ void Heap::_div_buddies(int order) {
         _free_blocks_num++;
         _free_blocks_bytes -= _get_Metadata_size();
         _all_bytes -= _get_Metadata_size();
+        _splits++;
     }
 
 }
 
-MallocMetadata *Heap::_get_best_fit_block(int order) {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+MallocMetadata *Heap<MinBlock, MaxOrder, NumBlocks>::_get_best_fit_block(int order) {
     if (_free_blocks[order].m_size == 0) {
-        if (order == MAX_ORDER) {
-            return nullptr;
+        if (order < MAX_ORDER) {
+            _div_buddies(order);
+        }
+        if (_free_blocks[order].m_size == 0 && _grow_pool() && order < MAX_ORDER) {
+            _div_buddies(order);
         }
-        _div_buddies(order);
         if (_free_blocks[order].m_size == 0) {
             return nullptr; // No block available even after splitting
         }
@@ -288,28 +431,32 @@ MallocMetadata *Heap::_get_best_fit_block(int order) {
     _free_blocks_bytes -= res->m_data_size;
 
     res->m_is_free = false;
+    res->m_is_hugepage = false;
     return res;
 }
 
-void* Heap::_alloc_block(size_t size) {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void* Heap<MinBlock, MaxOrder, NumBlocks>::_alloc_block(size_t size, int map_flags, bool *fresh) {
+    if (fresh) {
+        *fresh = false;
+    }
     if (size >= HUGEPAGE_THRESHOLD_SMALLOC) {
         size_t huge_page_size = 2 * 1024 * 1024; // 2MB HugePage size
         size_t aligned_size = ((size + huge_page_size - 1) / huge_page_size) * huge_page_size;
 
-        std::cerr << "Attempting HugePage allocation. Size: " << aligned_size << std::endl;
-
         void* ptr = mmap(nullptr, aligned_size + sizeof(MallocMetadata),
                          PROT_READ | PROT_WRITE,
-                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | map_flags, -1, 0);
+        _mmap_calls++;
 
         if (ptr == MAP_FAILED) {
-            perror("HugePage mmap failed. Falling back to normal mmap.");
+            // No HugePages reserved (or none left): fall back to normal pages
             ptr = mmap(nullptr, aligned_size + sizeof(MallocMetadata),
                        PROT_READ | PROT_WRITE,
-                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                       MAP_PRIVATE | MAP_ANONYMOUS | map_flags, -1, 0);
+            _mmap_calls++;
 
             if (ptr == MAP_FAILED) {
-                perror("Fallback mmap also failed");
                 return nullptr;
             }
         }
@@ -319,21 +466,33 @@ void* Heap::_alloc_block(size_t size) {
         newBlock->m_size = aligned_size + sizeof(MallocMetadata);
         newBlock->m_is_free = false;
         newBlock->m_is_hugepage = true;
+        newBlock->m_requested_size = size;
+        newBlock->m_next = nullptr;
+        newBlock->m_prev = nullptr;
 
-        std::cerr << "HugePage allocation succeeded. Address: " << ptr << std::endl;
+        _blocks_num++;
+        _all_bytes += newBlock->m_data_size;
+        _hugepage_blocks_num++;
+        _hugepage_bytes += newBlock->m_size;
+
+        if (fresh) {
+            *fresh = true; // HugePage blocks are never reused
+        }
         return (char*)ptr + sizeof(MallocMetadata);
     }
 
     // Default allocation logic for smaller sizes
-    size_t needed_size = static_cast<size_t>(ceil((size + sizeof(MallocMetadata)) / 128.0));
-    int order = std::ceil(std::log2(std::ceil(needed_size)));
+    int order = _get_order(size + sizeof(MallocMetadata));
 
     if (order > MAX_ORDER) {
-        return nullptr; // Cannot allocate beyond MAX_ORDER size
+        // Too big for the buddy pool but below the HugePage threshold
+        MallocMetadata *block = _alloc_large(size, order, map_flags, fresh);
+        return block ? (char *) block + sizeof(MallocMetadata) : nullptr;
     }
 
     MallocMetadata* ptr = _get_best_fit_block(order);
     if (ptr) {
+        ptr->m_requested_size = size;
         _free_blocks_num--;
         return (char*)ptr + sizeof(MallocMetadata); // Return usable block
     }
@@ -341,17 +500,33 @@ void* Heap::_alloc_block(size_t size) {
 }
 
 
-void Heap::_free_block(void *p) {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_free_block(void *p) {
     MallocMetadata *temp = _getMetaDataPtr(p);
     if (!temp) {
         return;
     }
 
-    // Check if it's a HugePage allocation
-    if (temp->m_size > HUGEPAGE_THRESHOLD_SMALLOC) {
-        munmap(temp, temp->m_size); // Free HugePage memory
+    // HugePage allocation, lives outside the buddy pool
+    if (temp->m_is_hugepage) {
+        size_t data_size = temp->m_data_size;
+        size_t block_size = temp->m_size;
+        munmap(temp, block_size);
         _blocks_num--;
-        _all_bytes -= temp->m_data_size;
+        _all_bytes -= data_size;
+        _munmap_calls++;
+        _hugepage_blocks_num--;
+        _hugepage_bytes -= block_size;
+        return;
+    }
+
+    // Plain mmap allocation or superblock
+    if (temp->m_size > MAX_BLOCK_SIZE) {
+        if (temp->m_is_free) {
+            return;
+        }
+        temp->m_is_free = true;
+        _release_large(temp, _get_order(temp->m_size), temp->m_size);
         return;
     }
 
@@ -360,8 +535,7 @@ void Heap::_free_block(void *p) {
         return;
     }
     temp->m_is_free = true;
-    size_t order = std::ceil(
-            std::log2(ceil(temp->m_size / static_cast<double>(128))));
+    size_t order = _get_order(temp->m_size);
     _allocated_blocks[order].remove(temp);
     _free_blocks[order].insert(temp);
     _free_blocks_num++;
@@ -370,7 +544,85 @@ void Heap::_free_block(void *p) {
     _merge_buddies(order); // Attempt to merge buddies
 }
 
-void Heap::_merge_buddies(size_t order) {
+// Blocks above MAX_BLOCK_SIZE. Up to the mmap threshold they are rounded to
+// their order's size and taken from the cache when one was freed before;
+// above it they are mapped at their exact size.
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+MallocMetadata *Heap<MinBlock, MaxOrder, NumBlocks>::_alloc_large(size_t size, int order, int map_flags,
+                                                                  bool *fresh) {
+    // The tail of the last page is usable as well
+    size_t block_size = (size + sizeof(MallocMetadata) + MMAP_PAGE_SIZE - 1) & ~(size_t)(MMAP_PAGE_SIZE - 1);
+    if (_order_size(order) <= _mmap_threshold) {
+        block_size = _order_size(order);
+        MallocMetadata *cached = _cached_blocks[order].m_head;
+        if (cached) {
+            _cached_blocks[order].remove(cached);
+            _cached_bytes -= block_size;
+            _free_blocks_num--;
+            _free_blocks_bytes -= cached->m_data_size;
+            _cache_hits++;
+            cached->m_is_free = false;
+            cached->m_requested_size = size;
+            return cached;
+        }
+    }
+
+    void *ptr = mmap(nullptr, block_size,
+                     PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | map_flags, -1, 0);
+    _mmap_calls++;
+    if (ptr == MAP_FAILED) {
+        return nullptr;
+    }
+    if (fresh) {
+        *fresh = true;
+    }
+
+    MallocMetadata *newBlock = (MallocMetadata *) ptr;
+    newBlock->m_data_size = block_size - sizeof(MallocMetadata);
+    newBlock->m_size = block_size;
+    newBlock->m_is_free = false;
+    newBlock->m_is_hugepage = false;
+    newBlock->m_requested_size = size;
+    newBlock->m_next = nullptr;
+    newBlock->m_prev = nullptr;
+
+    _blocks_num++;
+    _all_bytes += newBlock->m_data_size;
+    _mmap_blocks_num++;
+    _mmap_bytes += newBlock->m_size;
+
+    return newBlock;
+}
+
+// Keeps a freed superblock while the cache has room and unmaps anything else.
+// Unmapping a block above the threshold raises the threshold to the block's
+// order (up to SMALLOC_MMAP_THRESHOLD_MAX), so the next one is cached.
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_release_large(MallocMetadata *temp, int order, size_t size) {
+    if (size == _order_size(order) && size <= _mmap_threshold &&
+        _cached_bytes + size <= MMAP_CACHE_FACTOR * _mmap_threshold) {
+        _cached_blocks[order].insert(temp);
+        _cached_bytes += size;
+        _free_blocks_num++;
+        _free_blocks_bytes += temp->m_data_size;
+        return;
+    }
+
+    munmap(temp, size);
+    _blocks_num--;
+    _all_bytes -= size - sizeof(MallocMetadata);
+    _munmap_calls++;
+    _mmap_blocks_num--;
+    _mmap_bytes -= size;
+
+    if (size > _mmap_threshold && _order_size(order) <= SMALLOC_MMAP_THRESHOLD_MAX) {
+        _mmap_threshold = _order_size(order);
+        _threshold_raises++;
+    }
+}
+
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_merge_buddies(size_t order) {
     if (order == MAX_ORDER) {
         return;
     }
@@ -396,6 +648,7 @@ void Heap::_merge_buddies(size_t order) {
             _free_blocks_bytes += _get_Metadata_size();
             _all_bytes += _get_Metadata_size();
 
+            _merges++;
             _merge_buddies(order + 1);
             return;
 
@@ -404,7 +657,8 @@ void Heap::_merge_buddies(size_t order) {
     }
 }
 
-size_t Heap::_get_block_size(void *p) const {
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+size_t Heap<MinBlock, MaxOrder, NumBlocks>::_get_block_size(void *p) const {
     MallocMetadata *curr = _getMetaDataPtr(p);
     if (curr) {
         return curr->m_data_size;
@@ -412,163 +666,304 @@ size_t Heap::_get_block_size(void *p) const {
     return -1;
 }
 
-bool Heap::_check_merge(void *oldp, size_t size) {
-    MallocMetadata *p = _getMetaDataPtr(oldp);
-    size_t curr_size = p->m_size;
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_set_requested_size(void *p, size_t size) {
+    _getMetaDataPtr(p)->m_requested_size = size;
+}
 
-    while (true) {
-        // Compute the next block by moving `curr_size + metadata_size` forward
-        MallocMetadata *next_block = reinterpret_cast<MallocMetadata *>(
-                reinterpret_cast<size_t>(p) ^ curr_size);
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_count_call(StatCall call) {
+    if (call < STAT_CALL_KINDS) {
+        _calls[call]++;
+    }
+}
 
-        // Ensure the next block is valid and free before merging
-        if (!next_block || !next_block->m_is_free ||
-            curr_size >= (size + _get_Metadata_size())) {
-            break;
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void Heap<MinBlock, MaxOrder, NumBlocks>::_get_stats(HeapStats &stats) const {
+    memset(&stats, 0, sizeof(stats));
+    stats.m_num_orders = MAX_ORDER + 1;
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        OrderStats &o = stats.m_orders[i];
+        o.m_block_size = _order_size(i);
+        o.m_free_blocks = _free_blocks[i].m_size;
+        o.m_free_bytes = o.m_free_blocks * o.m_block_size;
+        o.m_allocated_blocks = _allocated_blocks[i].m_size;
+        o.m_allocated_bytes = o.m_allocated_blocks * o.m_block_size;
+        for (MallocMetadata *m = _allocated_blocks[i].m_head; m; m = m->m_next) {
+            o.m_requested_bytes += m->m_requested_size;
         }
-
-        // Merge by increasing the current size
-        curr_size += next_block->m_size;
-
-        // Move pointer to the merged block
-        p = next_block;
     }
-
-    return curr_size >= (size + _get_Metadata_size());
+    heap_stats_finish(stats);
+
+    stats.m_mmap_blocks = _mmap_blocks_num;
+    stats.m_mmap_bytes = _mmap_bytes;
+    stats.m_hugepage_blocks = _hugepage_blocks_num;
+    stats.m_hugepage_bytes = _hugepage_bytes;
+    memcpy(stats.m_calls, _calls, sizeof(_calls));
+    stats.m_splits = _splits;
+    stats.m_merges = _merges;
+    stats.m_mmap_calls = _mmap_calls;
+    stats.m_munmap_calls = _munmap_calls;
+    stats.m_mmap_threshold = _mmap_threshold;
+    stats.m_mmap_threshold_raises = _threshold_raises;
+    for (int i = MAX_ORDER + 1; i < STATS_MAX_ORDERS; i++) {
+        stats.m_cached_blocks += _cached_blocks[i].m_size;
+    }
+    stats.m_cached_bytes = _cached_bytes;
+    stats.m_cache_hits = _cache_hits;
 }
 
-void Heap::_merge_blocks_if_needed(void *oldp, size_t size) {
+// Grows an allocated buddy block to hold `size` bytes by absorbing its free
+// buddies, order by order, up to the smallest ancestor that is large enough.
+// A buddy is free when the header at its address is a free block of the same
+// order. Absorbing a lower buddy moves the block's start down, and the data
+// is moved with it. Returns the new user pointer, or nullptr without touching
+// the block when a buddy on the way is in use or the block is not a buddy
+// block.
+template <size_t MinBlock, int MaxOrder, size_t NumBlocks>
+void *Heap<MinBlock, MaxOrder, NumBlocks>::_grow_in_place(void *oldp, size_t size) {
     MallocMetadata *p = _getMetaDataPtr(oldp);
-    size_t curr_size = p->m_data_size;
-
-    while (true) {
-        // Compute the next block location
-        MallocMetadata *next_block = (MallocMetadata *) (
-                reinterpret_cast<intptr_t>(p) xor curr_size);
-
-        // Stop merging if:
-        // 1. The next block is not valid.
-        // 2. The next block is not free.
-        // 3. The total merged size already reaches/exceeds the required `size`.
-        if (!next_block || !next_block->m_is_free ||
-            curr_size >= (size + _get_Metadata_size())) {
-            break;
+    if (p->m_is_hugepage || p->m_size > MAX_BLOCK_SIZE) {
+        return nullptr; // mmapped blocks have no buddies
+    }
+    uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+    int old_order = _get_order(p->m_size);
+
+    uintptr_t base = addr;
+    int order = old_order;
+    while (_order_size(order) < size + _get_Metadata_size()) {
+        if (order >= MAX_ORDER) {
+            return nullptr;
         }
+        MallocMetadata *buddy = reinterpret_cast<MallocMetadata *>(base ^ _order_size(order));
+        if (!buddy->m_is_free || buddy->m_size != _order_size(order)) {
+            return nullptr;
+        }
+        base &= ~(uintptr_t) _order_size(order);
+        order++;
+    }
 
-        // Merge the block by adding its size
-        curr_size += next_block->m_size;
+    _allocated_blocks[old_order].remove(p);
+    uintptr_t curr = addr;
+    for (int i = old_order; i < order; i++) {
+        uintptr_t buddy_addr = curr ^ _order_size(i);
+        _free_blocks[i].remove(reinterpret_cast<MallocMetadata *>(buddy_addr));
 
         _blocks_num--;
         _free_blocks_num--;
         _all_bytes += _get_Metadata_size();
-        _free_blocks_bytes -= next_block->m_data_size;
+        _free_blocks_bytes -= _order_size(i) - _get_Metadata_size();
+        _merges++;
+        curr &= ~(uintptr_t) _order_size(i);
+    }
 
+    MallocMetadata *merged = reinterpret_cast<MallocMetadata *>(base);
+    if (base != addr) {
+        // The ranges overlap; the free buddies' headers below are no longer needed
+        memmove((char *) merged + _get_Metadata_size(), oldp, _order_size(old_order) - _get_Metadata_size());
+    }
+    merged->m_size = _order_size(order);
+    merged->m_data_size = merged->m_size - _get_Metadata_size();
+    merged->m_is_free = false;
+    merged->m_is_hugepage = false;
+    merged->m_requested_size = size;
+    _allocated_blocks[order].insert(merged);
 
-        // Mark the next block as merged (if you maintain a linked list, update the links)
-        p->m_size = curr_size +
-                    _get_Metadata_size();  // Upda te size of merged block
-        p->m_data_size = curr_size;
-        next_block->m_is_free = false;  // Mark the merged block as used (prevent reuse)
+    return (char *) merged + _get_Metadata_size();
+}
 
-        // Move to the next block for potential further merging
-        p = next_block;
-    }
+
+typedef Heap<SMALLOC_MIN_BLOCK, SMALLOC_MAX_ORDER, SMALLOC_NUM_BLOCKS> ProcessHeap;
+ProcessHeap heap;
+
+static void _heap_prefork() {
+    heap._prefork();
 }
 
+static void _heap_postfork_parent() {
+    heap._postfork_parent();
+}
 
-Heap heap;
+static void _heap_postfork_child() {
+    heap._postfork_child();
+}
 
-void *smalloc(size_t size) {
-    heap._init();
+// Holds the heap lock for the lifetime of the scope
+class HeapGuard {
+public:
+    HeapGuard() { heap._lock_heap(); }
+
+    ~HeapGuard() { heap._unlock_heap(); }
+
+    HeapGuard(const HeapGuard &) = delete;
+
+    HeapGuard &operator=(const HeapGuard &) = delete;
+};
+
+// With `usable` it also returns the block's usable size, taken under the same lock
+static void *_smalloc(size_t size, StatCall call, size_t *usable = nullptr) {
     if (size <= 0 || size > MAX_MEM) {
         return nullptr;
     }
-    void *ptr = heap._alloc_block(size);
+    HeapGuard guard;
+    heap._init();
+    heap._count_call(call);
+    // _alloc_block already returns the user pointer
+    void *res = heap._alloc_block(size);
+    if (usable) {
+        *usable = res ? heap._get_block_size(res) : 0;
+    }
+    return res;
+}
 
-    return (!ptr) ? nullptr : (char *) ptr + heap._get_Metadata_size();
+static void _sfree(void *ptr, StatCall call) {
+    if (ptr == nullptr) {
+        return;
+    }
+    HeapGuard guard;
+    heap._count_call(call);
+    heap._free_block(ptr);
+}
 
+void *smalloc(size_t size) {
+    return _smalloc(size, STAT_SMALLOC);
 }
 
-void *scalloc(size_t num, size_t size) {
-    size_t total_size = num * size;
+// Buddy blocks and superblocks are powers of two and HugePage blocks are
+// whole 2 MB pages, so *actual is often well above `size`
+void *smalloc_at_least(size_t size, size_t *actual) {
+    size_t usable = 0;
+    void *res = _smalloc(size, STAT_SMALLOC, &usable);
+    if (actual) {
+        *actual = usable;
+    }
+    return res;
+}
 
-    // Check if HugePage is required for the total allocation
-    if (total_size >= HUGEPAGE_THRESHOLD_SMALLOC ||
-        size >= HUGEPAGE_THRESHOLD_SCALLOC) {
-        void *res = heap._alloc_block(
-                total_size); // Allocate using HugePages if needed
-        if (!res) {
-            return nullptr;
-        }
-        memset(res, 0, total_size); // Initialize memory to zero
-        return res;
+// Blocks mapped for this call are already zero, since the kernel hands out
+// zeroed pages, so only buddy blocks and cached superblocks are cleared. A
+// large array is then faulted in page by page as it is first used, instead
+// of all at once by a memset here.
+static void *_scalloc(size_t num, size_t size, int map_flags) {
+    if (size && num > SIZE_MAX / size) {
+        return nullptr; // num * size overflows
     }
+    size_t total_size = num * size;
 
-    // Use the standard `smalloc` logic for smaller blocks
-    void *res = smalloc(total_size);
-    if (res) {
-        memset(res, 0, total_size); // Initialize memory to zero
+    // Large enough for HugePages, which are not bounded by MAX_MEM
+    bool huge = total_size >= HUGEPAGE_THRESHOLD_SMALLOC || size >= HUGEPAGE_THRESHOLD_SCALLOC;
+    if (!huge && (total_size <= 0 || total_size > MAX_MEM)) {
+        return nullptr;
+    }
+    void *res;
+    bool fresh;
+    {
+        HeapGuard guard;
+        heap._init();
+        heap._count_call(STAT_SCALLOC);
+        res = heap._alloc_block(total_size, map_flags, &fresh);
+    }
+    if (res && !fresh) {
+        memset(res, 0, total_size);
     }
     return res;
 }
 
+void *scalloc(size_t num, size_t size) {
+    return _scalloc(num, size, 0);
+}
+
+void *scalloc_populate(size_t num, size_t size) {
+    return _scalloc(num, size, MAP_POPULATE);
+}
+
 
 void sfree(void *ptr) {
-    if (ptr == nullptr) {
-        return;
-    }
-    heap._free_block(ptr);
+    _sfree(ptr, STAT_SFREE);
 }
 
 void *srealloc(void *oldp, size_t size) {
-    if (size <= 0 || size > MAX_BLOCK_SIZE) {
+    if (size <= 0 || size > MAX_MEM) {
         return nullptr;
     }
 
     if (oldp == nullptr) {
-        return smalloc(size);
+        return _smalloc(size, STAT_SREALLOC);
     }
 
-    if (heap._get_block_size(oldp) >= size) {
-        return oldp;
-    }
-    if (heap._check_merge(oldp, size)) {
-        heap._merge_blocks_if_needed(oldp, size);
-        return oldp;
+    size_t old_size;
+    {
+        HeapGuard guard;
+        heap._count_call(STAT_SREALLOC);
+        old_size = heap._get_block_size(oldp);
+        if (old_size >= size) {
+            heap._set_requested_size(oldp, size);
+            return oldp;
+        }
+        void *res = heap._grow_in_place(oldp, size);
+        if (res) {
+            return res;
+        }
     }
-    sfree(oldp);
-
-    void *res = smalloc(size);
 
+    // The old block stays valid until its data is copied, and stays
+    // allocated if there is no new block
+    void *res = _smalloc(size, STAT_NONE);
     if (res == nullptr) {
         return nullptr;
     }
-
-    memmove(res, oldp, size);
+    memcpy(res, oldp, old_size); // old_size < size
+    _sfree(oldp, STAT_NONE);
 
     return res;
 }
 
+size_t smalloc_usable_size(void *p) {
+    if (!p) {
+        return 0;
+    }
+    HeapGuard guard;
+    return heap._get_block_size(p);
+}
+
 size_t _num_free_blocks() {
+    HeapGuard guard;
     return heap._get_free_blocks_num();
 }
 
 size_t _num_free_bytes() {
+    HeapGuard guard;
     return heap._get_free_blocks_bytes();
 }
 
 size_t _num_allocated_blocks() {
+    HeapGuard guard;
     return heap._get_blocks_num();
 }
 
 size_t _num_allocated_bytes() {
+    HeapGuard guard;
     return heap._get_all_bytes();
 }
 
 size_t _num_meta_data_bytes() {
+    HeapGuard guard;
     return heap._get_Metadata_size() * heap._get_blocks_num();
 }
 
 size_t _size_meta_data() {
     return heap._get_Metadata_size();
-}
\ No newline at end of file
+}
+
+void smalloc_stats(HeapStats *stats) {
+    HeapGuard guard;
+    heap._get_stats(*stats);
+}
+
+bool smalloc_stats_dump_json(const char *path) {
+    HeapStats stats;
+    smalloc_stats(&stats);
+    return heap_stats_dump_json(stats, path);
+}
+
+SMALLOC_END_NAMESPACE
@@ -0,0 +1,255 @@
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <utility>
+#include <pthread.h>
+#include "heap_geometry.h"
+#include "smalloc.h"
+
+#define POOL_MAX_CHUNK_ORDER SMALLOC_MAX_ORDER // Chunks are buddy blocks, at most the max block
+#define POOL_BLOCK_OVERHEAD 64   // Upper bound on the allocator's block header
+#define POOL_CACHE_SLOTS 64      // Per-thread cache capacity
+#define POOL_CACHE_BATCH 32      // Slots moved between a cache and the pool at once
+
+// Fixed-size object pool: buddy blocks of order ChunkOrder (SMALLOC_MIN_BLOCK
+// << ChunkOrder bytes, with the geometry of heap_geometry.h) are taken from the heap and carved into T-sized slots kept on an
+// intrusive free stack, so allocation skips the order lookup and free lists
+// of smalloc. Chunks go back to the heap only when the pool is destroyed, and
+// every object must be destroyed by then.
+//
+// With ThreadCache each thread keeps up to POOL_CACHE_SLOTS free slots of its
+// own and takes the pool lock only to move a batch. The cache is per thread
+// and per T/ChunkOrder, so it serves one pool at a time, and such a pool must
+// outlive the threads that used it (typically a global pool).
+template <class T, int ChunkOrder = POOL_MAX_CHUNK_ORDER, bool ThreadCache = false>
+class ObjectPool {
+private:
+    union Slot {
+        Slot* m_next;
+        alignas(T) unsigned char m_storage[sizeof(T)];
+    };
+
+    struct Chunk {
+        Chunk* m_next;
+    };
+
+    struct ThreadSlots {
+        ObjectPool* m_owner;
+        Slot* m_head;
+        size_t m_count;
+        ~ThreadSlots() {
+            if (m_owner) {
+                m_owner->_release_cache(*this);
+            }
+        }
+    };
+
+    static_assert(ChunkOrder >= 0 && ChunkOrder <= POOL_MAX_CHUNK_ORDER,
+                  "ChunkOrder must be a buddy order");
+    static_assert(sizeof(Chunk) + alignof(Slot) + sizeof(Slot) + POOL_BLOCK_OVERHEAD <= ((size_t)SMALLOC_MIN_BLOCK << ChunkOrder),
+                  "T does not fit in a chunk of this order");
+
+    Slot* _free;
+    Chunk* _chunks;
+    pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+
+    static thread_local ThreadSlots _cache;
+
+    bool _add_chunk();
+    Slot* _pop_locked();
+    void _fill_cache(ThreadSlots& cache);
+    void _drain_cache(ThreadSlots& cache, size_t keep);
+    void _release_cache(ThreadSlots& cache);
+
+public:
+    ObjectPool() : _free(nullptr), _chunks(nullptr) {}
+    ~ObjectPool();
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    // Raw slots; nullptr when the heap is out of memory
+    void* _allocate();
+    void _deallocate(void* p);
+
+    // Constructs/destroys a T in a slot; _create returns nullptr without
+    // constructing anything when no slot is available
+    template <class... Args>
+    T* _create(Args&&... args);
+    void _destroy(T* p);
+};
+
+template <class T, int ChunkOrder, bool ThreadCache>
+thread_local typename ObjectPool<T, ChunkOrder, ThreadCache>::ThreadSlots
+        ObjectPool<T, ChunkOrder, ThreadCache>::_cache;
+
+template <class T, int ChunkOrder, bool ThreadCache>
+ObjectPool<T, ChunkOrder, ThreadCache>::~ObjectPool() {
+    if (ThreadCache && _cache.m_owner == this) {
+        _cache.m_owner = nullptr;
+        _cache.m_head = nullptr;
+        _cache.m_count = 0;
+    }
+    while (_chunks) {
+        Chunk* next = _chunks->m_next;
+        sfree(_chunks);
+        _chunks = next;
+    }
+    pthread_mutex_destroy(&_lock);
+}
+
+// Called with the lock held
+template <class T, int ChunkOrder, bool ThreadCache>
+bool ObjectPool<T, ChunkOrder, ThreadCache>::_add_chunk() {
+    size_t bytes = ((size_t)SMALLOC_MIN_BLOCK << ChunkOrder) - _size_meta_data(); // Exactly one block of ChunkOrder
+    Chunk* chunk = static_cast<Chunk*>(smalloc(bytes));
+    if (!chunk) {
+        return false;
+    }
+    chunk->m_next = _chunks;
+    _chunks = chunk;
+
+    uintptr_t start = reinterpret_cast<uintptr_t>(chunk + 1);
+    start = (start + alignof(Slot) - 1) & ~(uintptr_t)(alignof(Slot) - 1);
+    uintptr_t end = reinterpret_cast<uintptr_t>(chunk) + bytes;
+    // Pushed from the top so slots are handed out in address order
+    for (uintptr_t s = start + ((end - start) / sizeof(Slot) - 1) * sizeof(Slot); ; s -= sizeof(Slot)) {
+        Slot* slot = reinterpret_cast<Slot*>(s);
+        slot->m_next = _free;
+        _free = slot;
+        if (s == start) {
+            break;
+        }
+    }
+    return true;
+}
+
+// Called with the lock held
+template <class T, int ChunkOrder, bool ThreadCache>
+typename ObjectPool<T, ChunkOrder, ThreadCache>::Slot* ObjectPool<T, ChunkOrder, ThreadCache>::_pop_locked() {
+    if (!_free && !_add_chunk()) {
+        return nullptr;
+    }
+    Slot* slot = _free;
+    _free = slot->m_next;
+    return slot;
+}
+
+template <class T, int ChunkOrder, bool ThreadCache>
+void ObjectPool<T, ChunkOrder, ThreadCache>::_fill_cache(ThreadSlots& cache) {
+    pthread_mutex_lock(&_lock);
+    while (cache.m_count < POOL_CACHE_BATCH) {
+        Slot* slot = _pop_locked();
+        if (!slot) {
+            break;
+        }
+        slot->m_next = cache.m_head;
+        cache.m_head = slot;
+        cache.m_count++;
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+// Returns all but `keep` of the cached slots to the pool
+template <class T, int ChunkOrder, bool ThreadCache>
+void ObjectPool<T, ChunkOrder, ThreadCache>::_drain_cache(ThreadSlots& cache, size_t keep) {
+    if (cache.m_count <= keep) {
+        return;
+    }
+    Slot* first = cache.m_head;
+    Slot* last = first;
+    for (size_t i = cache.m_count - keep; i > 1; i--) {
+        last = last->m_next;
+    }
+    cache.m_head = last->m_next;
+    cache.m_count = keep;
+
+    pthread_mutex_lock(&_lock);
+    last->m_next = _free;
+    _free = first;
+    pthread_mutex_unlock(&_lock);
+}
+
+template <class T, int ChunkOrder, bool ThreadCache>
+void ObjectPool<T, ChunkOrder, ThreadCache>::_release_cache(ThreadSlots& cache) {
+    _drain_cache(cache, 0);
+    cache.m_owner = nullptr;
+}
+
+template <class T, int ChunkOrder, bool ThreadCache>
+void* ObjectPool<T, ChunkOrder, ThreadCache>::_allocate() {
+    if (ThreadCache) {
+        ThreadSlots& cache = _cache;
+        if (cache.m_owner != this) {
+            if (cache.m_owner) {
+                cache.m_owner->_release_cache(cache);
+            }
+            cache.m_owner = this;
+        }
+        if (!cache.m_head) {
+            _fill_cache(cache);
+            if (!cache.m_head) {
+                return nullptr;
+            }
+        }
+        Slot* slot = cache.m_head;
+        cache.m_head = slot->m_next;
+        cache.m_count--;
+        return slot;
+    }
+    pthread_mutex_lock(&_lock);
+    Slot* slot = _pop_locked();
+    pthread_mutex_unlock(&_lock);
+    return slot;
+}
+
+template <class T, int ChunkOrder, bool ThreadCache>
+void ObjectPool<T, ChunkOrder, ThreadCache>::_deallocate(void* p) {
+    if (!p) {
+        return;
+    }
+    Slot* slot = static_cast<Slot*>(p);
+    if (ThreadCache) {
+        ThreadSlots& cache = _cache;
+        if (cache.m_owner == this) {
+            slot->m_next = cache.m_head;
+            cache.m_head = slot;
+            if (++cache.m_count > POOL_CACHE_SLOTS) {
+                _drain_cache(cache, POOL_CACHE_SLOTS - POOL_CACHE_BATCH);
+            }
+            return;
+        }
+    }
+    pthread_mutex_lock(&_lock);
+    slot->m_next = _free;
+    _free = slot;
+    pthread_mutex_unlock(&_lock);
+}
+
+template <class T, int ChunkOrder, bool ThreadCache>
+template <class... Args>
+T* ObjectPool<T, ChunkOrder, ThreadCache>::_create(Args&&... args) {
+    void* p = _allocate();
+    if (!p) {
+        return nullptr;
+    }
+    try {
+        return new (p) T(std::forward<Args>(args)...);
+    } catch (...) {
+        _deallocate(p);
+        throw;
+    }
+}
+
+template <class T, int ChunkOrder, bool ThreadCache>
+void ObjectPool<T, ChunkOrder, ThreadCache>::_destroy(T* p) {
+    if (!p) {
+        return;
+    }
+    p->~T();
+    _deallocate(p);
+}
+
+#endif // OBJECT_POOL_H
@@ -0,0 +1,161 @@
+#ifndef PAGE_MAP_H
+#define PAGE_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define PAGE_MAP_SHIFT 12     // 4 KB pages
+#define PAGE_MAP_ADDR_BITS 48 // User-space virtual addresses on x86-64 and arm64
+#define PAGE_MAP_LEVEL_BITS 12
+#define PAGE_MAP_LEVEL_SIZE (1 << PAGE_MAP_LEVEL_BITS)
+#define META_POOL_CHUNK (64 * 1024)
+
+static_assert(PAGE_MAP_ADDR_BITS - PAGE_MAP_SHIFT == 3 * PAGE_MAP_LEVEL_BITS,
+              "the page map has three levels");
+
+// Radix tree from page number to a descriptor of what lives on the page,
+// covering the whole 48-bit address space. The root is part of the object;
+// the two lower levels are mmapped when a page under them is first set and
+// are never freed. Not thread-safe: the heap calls it under its lock.
+template <class T>
+class PageMap {
+private:
+    struct Leaf {
+        T* m_values[PAGE_MAP_LEVEL_SIZE];
+    };
+    struct Node {
+        Leaf* m_leaves[PAGE_MAP_LEVEL_SIZE];
+    };
+
+    Node* _root[PAGE_MAP_LEVEL_SIZE];
+
+    static void* _map_node(size_t bytes);
+    Leaf* _leaf(uintptr_t page, bool create);
+
+public:
+    PageMap() : _root() {}
+    PageMap(const PageMap&) = delete;
+    PageMap& operator=(const PageMap&) = delete;
+
+    // Descriptor of the page holding `p`, nullptr if none was set
+    T* _get(const void* p) const;
+
+    // Points every page overlapping [start, start + bytes) at `value`
+    // (nullptr clears them). Returns false when a node cannot be mapped.
+    bool _set(const void* start, size_t bytes, T* value);
+};
+
+template <class T>
+inline void* PageMap<T>::_map_node(size_t bytes) {
+    void* mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    return mem == MAP_FAILED ? nullptr : mem; // mmap memory is zeroed
+}
+
+template <class T>
+inline typename PageMap<T>::Leaf* PageMap<T>::_leaf(uintptr_t page, bool create) {
+    Node*& node = _root[page >> (2 * PAGE_MAP_LEVEL_BITS)];
+    if (!node) {
+        if (!create) {
+            return nullptr;
+        }
+        node = static_cast<Node*>(_map_node(sizeof(Node)));
+        if (!node) {
+            return nullptr;
+        }
+    }
+    Leaf*& leaf = node->m_leaves[(page >> PAGE_MAP_LEVEL_BITS) & (PAGE_MAP_LEVEL_SIZE - 1)];
+    if (!leaf && create) {
+        leaf = static_cast<Leaf*>(_map_node(sizeof(Leaf)));
+    }
+    return leaf;
+}
+
+template <class T>
+inline T* PageMap<T>::_get(const void* p) const {
+    uintptr_t page = reinterpret_cast<uintptr_t>(p) >> PAGE_MAP_SHIFT;
+    if (page >> (3 * PAGE_MAP_LEVEL_BITS)) {
+        return nullptr;
+    }
+    const Node* node = _root[page >> (2 * PAGE_MAP_LEVEL_BITS)];
+    if (!node) {
+        return nullptr;
+    }
+    const Leaf* leaf = node->m_leaves[(page >> PAGE_MAP_LEVEL_BITS) & (PAGE_MAP_LEVEL_SIZE - 1)];
+    return leaf ? leaf->m_values[page & (PAGE_MAP_LEVEL_SIZE - 1)] : nullptr;
+}
+
+template <class T>
+inline bool PageMap<T>::_set(const void* start, size_t bytes, T* value) {
+    uintptr_t first = reinterpret_cast<uintptr_t>(start) >> PAGE_MAP_SHIFT;
+    uintptr_t last = (reinterpret_cast<uintptr_t>(start) + bytes - 1) >> PAGE_MAP_SHIFT;
+    if (!bytes || (last >> (3 * PAGE_MAP_LEVEL_BITS))) {
+        return false;
+    }
+    for (uintptr_t page = first; page <= last; page++) {
+        Leaf* leaf = _leaf(page, value != nullptr);
+        if (leaf) {
+            leaf->m_values[page & (PAGE_MAP_LEVEL_SIZE - 1)] = value;
+        } else if (value) {
+            return false;
+        } else {
+            // Nothing was ever set under this leaf
+            page |= PAGE_MAP_LEVEL_SIZE - 1;
+        }
+    }
+    return true;
+}
+
+// Fixed-size records for the allocator's own metadata, carved from mmapped
+// chunks and kept on a free list, since the heap cannot allocate them from
+// itself. Chunks are never unmapped. Not thread-safe.
+template <class T>
+class MetaPool {
+private:
+    union Slot {
+        Slot* m_next;
+        alignas(T) unsigned char m_storage[sizeof(T)];
+    };
+
+    Slot* _free_slots;
+    char* _cur;
+    char* _end;
+
+public:
+    MetaPool() : _free_slots(nullptr), _cur(nullptr), _end(nullptr) {}
+    MetaPool(const MetaPool&) = delete;
+    MetaPool& operator=(const MetaPool&) = delete;
+
+    // Uninitialized storage for one T; nullptr when mmap fails
+    T* _allocate();
+    void _deallocate(T* p);
+};
+
+template <class T>
+inline T* MetaPool<T>::_allocate() {
+    if (_free_slots) {
+        Slot* slot = _free_slots;
+        _free_slots = slot->m_next;
+        return reinterpret_cast<T*>(slot);
+    }
+    if (_end - _cur < (ptrdiff_t)sizeof(Slot)) {
+        void* mem = mmap(nullptr, META_POOL_CHUNK, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+        if (mem == MAP_FAILED) {
+            return nullptr;
+        }
+        _cur = static_cast<char*>(mem);
+        _end = _cur + META_POOL_CHUNK;
+    }
+    Slot* slot = reinterpret_cast<Slot*>(_cur);
+    _cur += sizeof(Slot);
+    return reinterpret_cast<T*>(slot);
+}
+
+template <class T>
+inline void MetaPool<T>::_deallocate(T* p) {
+    Slot* slot = reinterpret_cast<Slot*>(p);
+    slot->m_next = _free_slots;
+    _free_slots = slot;
+}
+
+#endif // PAGE_MAP_H
@@ -0,0 +1,84 @@
+#ifndef RESERVED_RANGE_H
+#define RESERVED_RANGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define RESERVED_RANGE_PAGE 4096
+
+// A contiguous range of address space reserved with mmap(PROT_NONE) and
+// handed out from the bottom up. Pages become readable and writable only
+// when _extend() first reaches them, so untouched parts of the range cost
+// neither memory nor commit charge, and nothing else in the process (brk
+// users included) can be placed inside it. Not thread-safe: the heap calls
+// it under its lock.
+class ReservedRange {
+private:
+    char* _base;
+    size_t _size;
+    size_t _used;      // Handed out by _extend()
+    size_t _committed; // Readable and writable, a whole number of pages
+
+public:
+    ReservedRange() : _base(nullptr), _size(0), _used(0), _committed(0) {}
+    ReservedRange(const ReservedRange&) = delete;
+    ReservedRange& operator=(const ReservedRange&) = delete;
+
+    // Reserves `bytes` starting at a multiple of `alignment` (a power of
+    // two). False when the address space cannot be reserved.
+    bool _reserve(size_t bytes, size_t alignment);
+
+    // The next `bytes` of the range, committed; nullptr once it is used up
+    // or the pages cannot be committed
+    void* _extend(size_t bytes);
+
+    char* _start() const { return _base; }
+    size_t _size_bytes() const { return _size; }
+    size_t _used_bytes() const { return _used; }
+};
+
+inline bool ReservedRange::_reserve(size_t bytes, size_t alignment) {
+    size_t mapped = (bytes + RESERVED_RANGE_PAGE - 1) & ~(size_t)(RESERVED_RANGE_PAGE - 1);
+    if (alignment < RESERVED_RANGE_PAGE) {
+        alignment = RESERVED_RANGE_PAGE;
+    }
+    // Over-reserve by the alignment and give back both ends
+    size_t span = mapped + alignment - RESERVED_RANGE_PAGE;
+    void* mem = mmap(nullptr, span, PROT_NONE, MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        return false;
+    }
+    uintptr_t start = reinterpret_cast<uintptr_t>(mem);
+    uintptr_t aligned = (start + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (aligned > start) {
+        munmap(mem, aligned - start);
+    }
+    if (start + span > aligned + mapped) {
+        munmap(reinterpret_cast<void*>(aligned + mapped), start + span - (aligned + mapped));
+    }
+    _base = reinterpret_cast<char*>(aligned);
+    _size = bytes;
+    _used = 0;
+    _committed = 0;
+    return true;
+}
+
+inline void* ReservedRange::_extend(size_t bytes) {
+    if (!_base || bytes > _size - _used) {
+        return nullptr;
+    }
+    size_t end = _used + bytes;
+    if (end > _committed) {
+        size_t commit_end = (end + RESERVED_RANGE_PAGE - 1) & ~(size_t)(RESERVED_RANGE_PAGE - 1);
+        if (mprotect(_base + _committed, commit_end - _committed, PROT_READ | PROT_WRITE) != 0) {
+            return nullptr;
+        }
+        _committed = commit_end;
+    }
+    void* p = _base + _used;
+    _used = end;
+    return p;
+}
+
+#endif // RESERVED_RANGE_H
@@ -0,0 +1,171 @@
+#ifndef SMALLOC_H
+#define SMALLOC_H
+
+#include <stddef.h>
+#include "heap_stats.h"
+
+// Interface shared by every allocator variant (malloc_1.cpp .. malloc_4.cpp).
+//
+// Built on its own (g++ malloc_3.cpp ...) a variant defines these functions in
+// the global namespace. The CMake library targets compile each variant with
+// -DSMALLOC_NAMESPACE=malloc_<n> instead, which moves the whole variant,
+// including its Heap, into that namespace so several variants can be linked
+// into one binary. Code using one library defines SMALLOC_NAMESPACE the same
+// way and keeps calling smalloc() unqualified; code comparing several
+// variants declares them with SMALLOC_DECLARE_API(malloc_<n>) and qualifies.
+
+// Core API. malloc_1 only provides smalloc.
+#define SMALLOC_CORE_API                                  \
+    void* smalloc(size_t size);                           \
+    void* scalloc(size_t num, size_t size);               \
+    void sfree(void* p);                                  \
+    void* srealloc(void* oldp, size_t size);              \
+    size_t _num_free_blocks();                            \
+    size_t _num_free_bytes();                             \
+    size_t _num_allocated_blocks();                       \
+    size_t _num_allocated_bytes();                        \
+    size_t _num_meta_data_bytes();                        \
+    size_t _size_meta_data();
+
+#define SMALLOC_DECLARE_API(ns) namespace ns { SMALLOC_CORE_API }
+
+#ifdef SMALLOC_NAMESPACE
+#define SMALLOC_BEGIN_NAMESPACE namespace SMALLOC_NAMESPACE {
+#define SMALLOC_END_NAMESPACE }
+#else
+#define SMALLOC_BEGIN_NAMESPACE
+#define SMALLOC_END_NAMESPACE
+#endif
+
+SMALLOC_BEGIN_NAMESPACE
+
+SMALLOC_CORE_API
+
+// Usable size of an allocated block, which can be more than was asked for;
+// the caller may use all of it. smalloc_at_least returns that size in
+// *actual (malloc_2 .. malloc_4).
+size_t smalloc_usable_size(void* p);
+void* smalloc_at_least(size_t size, size_t* actual);
+
+// Heap statistics (malloc_3, malloc_4)
+void smalloc_stats(HeapStats* stats);
+bool smalloc_stats_dump_json(const char* path);
+
+// scalloc that also faults in the pages of a block it maps, with
+// MAP_POPULATE, for callers that want no page faults on first use. Blocks
+// taken from the buddy pool or the superblock cache are zeroed as usual
+// (malloc_4).
+void* scalloc_populate(size_t num, size_t size);
+
+// Free with the allocation size instead of looking it up; a size that does
+// not match the block falls back to the lookup (malloc_3)
+void sfree_sized(void* p, size_t size);
+
+// Whether p points into memory managed by the heap (malloc_3)
+bool smalloc_owns(const void* p);
+
+// Regions (malloc_3): bump allocation over 128 KB buddy blocks, aligned like
+// smalloc, all freed at once by region_reset/region_destroy. Not thread-safe.
+struct Region;
+Region* region_create();
+void* region_alloc(Region* region, size_t size);
+void region_reset(Region* region);
+void region_destroy(Region* region);
+// Caps the bytes a region takes from the heap; 0 (the default) for no cap
+void region_set_limit(Region* region, size_t bytes);
+
+// Heap consistency checks (malloc_3). smalloc_heap_check verifies the whole
+// heap and reports the first problem on stderr. smalloc_heap_check_every(n)
+// checks the counters and one 128 KB block of the pool every n calls, and
+// aborts on a problem; 0 turns it off.
+bool smalloc_heap_check();
+void smalloc_heap_check_every(size_t ops);
+
+// Sampling heap profiler (malloc_3)
+void smalloc_profile_set_rate(size_t bytes);
+size_t smalloc_profile_get_rate();
+bool smalloc_profile_dump(const char* path);
+
+// Memory budget (malloc_3) over the bytes of blocks in use, headers
+// included, plus cached mmapped blocks. Going over the soft limit gives free
+// memory back to the system and calls the callback, once per crossing; an
+// allocation that would go over the hard limit calls it too and fails. The
+// callback runs without the heap lock and may free memory. 0 means no limit;
+// false when soft is above hard. Each NUMA arena (0 .. smalloc_arena_count()
+// - 1) can also get limits of its own, checked next to the process-wide ones;
+// smalloc_budget_set_arena returns false for an arena that does not exist.
+typedef void (*BudgetCallback)(size_t used_bytes, void* arg);
+bool smalloc_budget_set(size_t soft_bytes, size_t hard_bytes);
+void smalloc_budget_set_callback(BudgetCallback callback, void* arg);
+size_t smalloc_budget_used();
+int smalloc_arena_count();
+bool smalloc_budget_set_arena(int arena, size_t soft_bytes, size_t hard_bytes);
+size_t smalloc_budget_arena_used(int arena);
+
+// Guard-page sampling (malloc_3): about one smalloc in `calls` is served on
+// its own page between inaccessible pages, and the page becomes inaccessible
+// when the block is freed. Overflows and uses after free then fault with the
+// block's allocation and free stacks on stderr. 0 turns it off; false when
+// the pool cannot be mapped.
+bool smalloc_guard_set_rate(size_t calls);
+size_t smalloc_guard_get_rate();
+
+// Allocation trace recorder (malloc_3)
+bool smalloc_trace_start(const char* path);
+void smalloc_trace_stop();
+
+#ifdef SMALLOC_INSTRUMENT
+// Latency histograms (malloc_3 built with -DSMALLOC_INSTRUMENT)
+bool smalloc_latency_dump(const char* path);
+void smalloc_latency_reset();
+#endif
+
+SMALLOC_END_NAMESPACE
+
+#ifdef SMALLOC_NAMESPACE
+using SMALLOC_NAMESPACE::smalloc;
+using SMALLOC_NAMESPACE::scalloc;
+using SMALLOC_NAMESPACE::sfree;
+using SMALLOC_NAMESPACE::srealloc;
+using SMALLOC_NAMESPACE::_num_free_blocks;
+using SMALLOC_NAMESPACE::_num_free_bytes;
+using SMALLOC_NAMESPACE::_num_allocated_blocks;
+using SMALLOC_NAMESPACE::_num_allocated_bytes;
+using SMALLOC_NAMESPACE::_num_meta_data_bytes;
+using SMALLOC_NAMESPACE::_size_meta_data;
+using SMALLOC_NAMESPACE::smalloc_usable_size;
+using SMALLOC_NAMESPACE::smalloc_at_least;
+using SMALLOC_NAMESPACE::scalloc_populate;
+using SMALLOC_NAMESPACE::sfree_sized;
+using SMALLOC_NAMESPACE::smalloc_owns;
+using SMALLOC_NAMESPACE::Region;
+using SMALLOC_NAMESPACE::region_create;
+using SMALLOC_NAMESPACE::region_alloc;
+using SMALLOC_NAMESPACE::region_reset;
+using SMALLOC_NAMESPACE::region_destroy;
+using SMALLOC_NAMESPACE::region_set_limit;
+using SMALLOC_NAMESPACE::smalloc_stats;
+using SMALLOC_NAMESPACE::smalloc_stats_dump_json;
+using SMALLOC_NAMESPACE::smalloc_heap_check;
+using SMALLOC_NAMESPACE::smalloc_heap_check_every;
+using SMALLOC_NAMESPACE::smalloc_profile_set_rate;
+using SMALLOC_NAMESPACE::smalloc_profile_get_rate;
+using SMALLOC_NAMESPACE::smalloc_profile_dump;
+using SMALLOC_NAMESPACE::BudgetCallback;
+using SMALLOC_NAMESPACE::smalloc_budget_set;
+using SMALLOC_NAMESPACE::smalloc_budget_set_callback;
+using SMALLOC_NAMESPACE::smalloc_budget_used;
+using SMALLOC_NAMESPACE::smalloc_arena_count;
+using SMALLOC_NAMESPACE::smalloc_budget_set_arena;
+using SMALLOC_NAMESPACE::smalloc_budget_arena_used;
+using SMALLOC_NAMESPACE::smalloc_guard_set_rate;
+using SMALLOC_NAMESPACE::smalloc_guard_get_rate;
+using SMALLOC_NAMESPACE::smalloc_trace_start;
+using SMALLOC_NAMESPACE::smalloc_trace_stop;
+#ifdef SMALLOC_INSTRUMENT
+using SMALLOC_NAMESPACE::smalloc_latency_dump;
+using SMALLOC_NAMESPACE::smalloc_latency_reset;
+#endif
+#endif
+
+#endif // SMALLOC_H
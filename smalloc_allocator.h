@@ -0,0 +1,113 @@
+#ifndef SMALLOC_ALLOCATOR_H
+#define SMALLOC_ALLOCATOR_H
+
+// Standard library adaptors over the smalloc API (malloc_3, which has
+// sfree_sized): SmallocAllocator<T> for the allocator-aware containers and,
+// when compiled as C++17, smalloc_resource() for std::pmr containers. Both
+// pass the size the container hands back on deallocation to sfree_sized.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#endif
+#include "smalloc.h"
+
+// Blocks start right after a 48-byte header on a 128-byte aligned buddy (or
+// a page for mmap blocks), so 16-byte alignment comes for free
+#define SMALLOC_ALIGNMENT 16
+
+// Stronger alignments over-allocate by `align` and keep the pointer smalloc
+// returned in the word just below the aligned one
+inline void* smalloc_allocate(size_t bytes, size_t align) {
+    if (bytes == 0) {
+        bytes = 1; // smalloc(0) fails, the standard allocators must not
+    }
+    if (align <= SMALLOC_ALIGNMENT) {
+        return smalloc(bytes);
+    }
+    void* raw = smalloc(bytes + align);
+    if (!raw) {
+        return nullptr;
+    }
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + align) & ~(uintptr_t)(align - 1);
+    reinterpret_cast<void**>(aligned)[-1] = raw;
+    return reinterpret_cast<void*>(aligned);
+}
+
+inline void smalloc_deallocate(void* p, size_t bytes, size_t align) {
+    if (bytes == 0) {
+        bytes = 1;
+    }
+    if (align <= SMALLOC_ALIGNMENT) {
+        sfree_sized(p, bytes);
+    } else {
+        sfree_sized(reinterpret_cast<void**>(p)[-1], bytes + align);
+    }
+}
+
+template <class T>
+class SmallocAllocator {
+public:
+    typedef T value_type;
+
+    SmallocAllocator() noexcept {}
+    template <class U>
+    SmallocAllocator(const SmallocAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        if (n > SIZE_MAX / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        void* p = smalloc_allocate(n * sizeof(T), alignof(T));
+        if (!p) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        smalloc_deallocate(p, n * sizeof(T), alignof(T));
+    }
+};
+
+// Stateless: every instance allocates from the same heap
+template <class T, class U>
+bool operator==(const SmallocAllocator<T>&, const SmallocAllocator<U>&) noexcept {
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const SmallocAllocator<T>&, const SmallocAllocator<U>&) noexcept {
+    return false;
+}
+
+#if __cplusplus >= 201703L
+class SmallocResource : public std::pmr::memory_resource {
+protected:
+    void* do_allocate(size_t bytes, size_t align) override {
+        void* p = smalloc_allocate(bytes, align);
+        if (!p) {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t align) override {
+        smalloc_deallocate(p, bytes, align);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return dynamic_cast<const SmallocResource*>(&other) != nullptr;
+    }
+};
+
+// The process-wide resource, like std::pmr::new_delete_resource()
+inline std::pmr::memory_resource* smalloc_resource() noexcept {
+    static SmallocResource resource;
+    return &resource;
+}
+#endif
+
+#endif // SMALLOC_ALLOCATOR_H
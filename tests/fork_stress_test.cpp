@@ -0,0 +1,177 @@
+// fork() while other threads allocate: the atfork handlers must leave the
+// child a heap it can keep using. Worker threads allocate, fill, check and
+// free blocks of mixed sizes (buddy and mmapped) while the main thread forks
+// repeatedly. Each child allocates from the main thread and from a new
+// thread, and checks the heap (malloc_3) before exiting. A child that
+// deadlocks is killed by an alarm and fails the test.
+#include "../smalloc.h"
+#include "check.h"
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <atomic>
+
+#define WORKERS 4
+#define FORKS 50
+#define SLOTS 64
+#define CHILD_OPS 2000
+#define CHILD_TIMEOUT 10 // Seconds before a hung child is killed
+
+static std::atomic<bool> stop_workers(false);
+
+struct Slot {
+    unsigned char* m_block;
+    size_t m_size;
+    unsigned char m_fill;
+};
+
+static uint64_t next_random(uint64_t& x) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+// Mostly small blocks, one in 32 above the 128 KB max block so it is mmapped
+static size_t random_size(uint64_t& x) {
+    uint64_t r = next_random(x);
+    return r % 32 == 0 ? 128 * 1024 + r % (192 * 1024) : 1 + r % 2000;
+}
+
+static bool intact(const Slot& slot) {
+    for (size_t i = 0; i < slot.m_size; i++) {
+        if (slot.m_block[i] != slot.m_fill) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// One allocation, reallocation or free on a random slot; false when a block
+// was not handed out or lost its contents
+static bool step(Slot* slots, uint64_t& x) {
+    Slot& slot = slots[next_random(x) % SLOTS];
+    if (slot.m_block && !intact(slot)) {
+        return false;
+    }
+    uint64_t action = next_random(x) % 4;
+    if (slot.m_block && action == 0) {
+        sfree(slot.m_block);
+        slot.m_block = nullptr;
+        return true;
+    }
+    size_t size = random_size(x);
+    void* p;
+    if (slot.m_block && action == 1) {
+        p = srealloc(slot.m_block, size);
+        if (p) {
+            size_t kept = size < slot.m_size ? size : slot.m_size;
+            slot.m_block = static_cast<unsigned char*>(p);
+            slot.m_size = kept;
+            if (!intact(slot)) {
+                return false;
+            }
+        }
+    } else {
+        sfree(slot.m_block);
+        p = action == 2 ? scalloc(1, size) : smalloc(size);
+    }
+    if (!p) {
+        return false;
+    }
+    slot.m_block = static_cast<unsigned char*>(p);
+    slot.m_size = size;
+    slot.m_fill = (unsigned char)next_random(x);
+    memset(slot.m_block, slot.m_fill, size);
+    return true;
+}
+
+static void release(Slot* slots) {
+    for (int i = 0; i < SLOTS; i++) {
+        sfree(slots[i].m_block);
+        slots[i].m_block = nullptr;
+    }
+}
+
+static void* run_worker(void* arg) {
+    uint64_t x = 0x9E3779B97F4A7C15ull + (uintptr_t)arg;
+    Slot slots[SLOTS] = {};
+    while (!stop_workers.load(std::memory_order_relaxed)) {
+        CHECK(step(slots, x));
+    }
+    release(slots);
+    return nullptr;
+}
+
+static void* run_child_thread(void* arg) {
+    uint64_t x = 0x2545F4914F6CDD1Dull + (uintptr_t)arg;
+    Slot slots[SLOTS] = {};
+    for (int i = 0; i < CHILD_OPS; i++) {
+        if (!step(slots, x)) {
+            return arg; // Any non-null value reports the failure
+        }
+    }
+    release(slots);
+    return nullptr;
+}
+
+static bool heap_ok() {
+#ifdef FORK_TEST_HEAP_CHECK
+    return smalloc_heap_check();
+#else
+    return true;
+#endif
+}
+
+// Runs in the forked child; the exit status is the result
+static void run_child(int round) {
+    alarm(CHILD_TIMEOUT);
+    CHECK(heap_ok());
+    uint64_t x = 0xD1B54A32D192ED03ull + (uint64_t)round;
+    Slot slots[SLOTS] = {};
+    for (int i = 0; i < CHILD_OPS; i++) {
+        CHECK(step(slots, x));
+    }
+    pthread_t thread;
+    void* failed = nullptr;
+    CHECK(pthread_create(&thread, nullptr, run_child_thread, (void*)(uintptr_t)(round + 1)) == 0);
+    CHECK(pthread_join(thread, &failed) == 0);
+    CHECK(!failed);
+    release(slots);
+    CHECK(heap_ok());
+    _exit(0);
+}
+
+int main() {
+    // Registers the atfork handlers before anything forks
+    sfree(smalloc(1));
+
+    pthread_t workers[WORKERS];
+    for (int i = 0; i < WORKERS; i++) {
+        CHECK(pthread_create(&workers[i], nullptr, run_worker, (void*)(uintptr_t)(i + 1)) == 0);
+    }
+    for (int round = 0; round < FORKS; round++) {
+        usleep(1000); // Lets the workers get back into the heap
+        pid_t pid = fork();
+        CHECK(pid >= 0);
+        if (pid == 0) {
+            run_child(round);
+        }
+        int status = 0;
+        CHECK(waitpid(pid, &status, 0) == pid);
+        if (WIFSIGNALED(status)) {
+            fprintf(stderr, "child %d killed by signal %d%s\n", round, WTERMSIG(status),
+                    WTERMSIG(status) == SIGALRM ? " (deadlocked)" : "");
+        }
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    stop_workers.store(true);
+    for (int i = 0; i < WORKERS; i++) {
+        CHECK(pthread_join(workers[i], nullptr) == 0);
+    }
+    CHECK(heap_ok());
+    return 0;
+}
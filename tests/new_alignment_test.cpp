@@ -0,0 +1,65 @@
+// operator new on malloc_3 (built with SMALLOC_OVERRIDE_NEW) must return
+// memory aligned to __STDCPP_DEFAULT_NEW_ALIGNMENT__ for buddy, mmapped and
+// guarded blocks alike.
+#include "../smalloc.h"
+#include "check.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <vector>
+
+static const size_t ALIGNMENT = 16;
+
+static bool aligned(const void* p) {
+    return reinterpret_cast<uintptr_t>(p) % ALIGNMENT == 0;
+}
+
+int main() {
+#ifdef __STDCPP_DEFAULT_NEW_ALIGNMENT__ // C++17
+    CHECK(ALIGNMENT >= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+#endif
+    CHECK(ALIGNMENT >= alignof(max_align_t));
+
+    // Kept alive in batches, so neighbouring blocks are handed out as well
+    std::vector<char*> arrays;
+    for (size_t n = 0; n <= 4096; n++) {
+        char* a = new char[n];
+        CHECK(aligned(a));
+        arrays.push_back(a);
+        if (arrays.size() == 64) {
+            for (char* b : arrays) {
+                delete[] b;
+            }
+            arrays.clear();
+        }
+    }
+    for (size_t n = 4096; n <= (size_t)8 << 20; n = n * 3 / 2) {
+        char* a = new char[n];
+        CHECK(aligned(a));
+        char* b = new (std::nothrow) char[n];
+        CHECK(b && aligned(b));
+        arrays.push_back(a);
+        arrays.push_back(b);
+    }
+    for (char* a : arrays) {
+        delete[] a;
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        long double* x = new long double(i);
+        max_align_t* m = new max_align_t;
+        CHECK(aligned(x) && aligned(m));
+        delete x;
+        delete m;
+    }
+
+    // Sampled blocks come from the guarded pool, right-aligned in a page
+    CHECK(smalloc_guard_set_rate(1));
+    for (size_t n = 1; n <= 256; n++) {
+        char* a = new char[n];
+        CHECK(aligned(a));
+        delete[] a;
+    }
+    smalloc_guard_set_rate(0);
+    return 0;
+}
@@ -0,0 +1,140 @@
+// srealloc against glibc realloc: random blocks are grown, shrunk and
+// resized to the same size side by side in both allocators, with identical
+// random contents, and must still hold the same bytes afterwards. Checks the
+// smalloc_usable_size invariants (never below the request, unchanged block
+// when the request fits) and the whole heap after every step. Blocks are
+// freed with sfree_sized. A second pass samples blocks into the guarded pool
+// as well.
+#include "../smalloc.h"
+#include "check.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOTS 128
+#define STEPS 20000
+#define MAX_SIZE (640 * 1024) // Well past the 128 KB max block, so some blocks are mmapped
+
+struct Pair {
+    unsigned char* m_block; // From smalloc/srealloc
+    unsigned char* m_copy;  // From glibc malloc/realloc
+    size_t m_size;
+};
+
+static uint64_t next_random(uint64_t& x) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+// Mostly small sizes, some up to the max block and a few beyond it
+static size_t random_size(uint64_t& x) {
+    uint64_t r = next_random(x);
+    switch (r % 8) {
+    case 0:
+        return 1 + r % MAX_SIZE;
+    case 1:
+    case 2:
+        return 1 + r % (128 * 1024);
+    default:
+        return 1 + r % 2000;
+    }
+}
+
+// The same random bytes into [from, to) of both blocks
+static void fill(Pair& pair, size_t from, size_t to, uint64_t& x) {
+    for (size_t i = from; i < to; i++) {
+        unsigned char byte = (unsigned char)next_random(x);
+        pair.m_block[i] = byte;
+        pair.m_copy[i] = byte;
+    }
+}
+
+// New size for a live block: larger, smaller or the same
+static size_t resized(size_t size, uint64_t& x) {
+    uint64_t r = next_random(x);
+    switch (r % 6) {
+    case 0:
+        return size;
+    case 1:
+        return 1 + r % size;
+    case 2:
+        return size + 1 + r % size < MAX_SIZE ? size + 1 + r % size : MAX_SIZE;
+    case 3:
+        return size + 1 < MAX_SIZE ? size + 1 : size;
+    default:
+        return random_size(x);
+    }
+}
+
+static void step(Pair& pair, uint64_t& x) {
+    if (!pair.m_block) {
+        size_t size = random_size(x);
+        pair.m_block = static_cast<unsigned char*>(srealloc(nullptr, size));
+        pair.m_copy = static_cast<unsigned char*>(realloc(nullptr, size));
+        CHECK(pair.m_block && pair.m_copy);
+        CHECK(smalloc_usable_size(pair.m_block) >= size);
+        pair.m_size = size;
+        fill(pair, 0, size, x);
+        return;
+    }
+    if (next_random(x) % 8 == 0) {
+        // With the last size asked for, which a block resized in place may
+        // not have been allocated with
+        sfree_sized(pair.m_block, pair.m_size);
+        free(pair.m_copy);
+        pair.m_block = nullptr;
+        pair.m_copy = nullptr;
+        return;
+    }
+
+    size_t size = resized(pair.m_size, x);
+    size_t old_usable = smalloc_usable_size(pair.m_block);
+    CHECK(old_usable >= pair.m_size);
+    unsigned char* old_block = pair.m_block;
+    unsigned char* block = static_cast<unsigned char*>(srealloc(pair.m_block, size));
+    unsigned char* copy = static_cast<unsigned char*>(realloc(pair.m_copy, size));
+    CHECK(block && copy);
+    pair.m_block = block;
+    pair.m_copy = copy;
+
+    size_t usable = smalloc_usable_size(block);
+    CHECK(usable >= size);
+    if (size <= old_usable) {
+        // Shrinking, or growing within the block's slack, never moves it
+        CHECK(block == old_block && usable == old_usable);
+    }
+    size_t kept = size < pair.m_size ? size : pair.m_size;
+    CHECK(memcmp(block, copy, kept) == 0);
+    if (size > pair.m_size) {
+        fill(pair, pair.m_size, size, x);
+    }
+    pair.m_size = size;
+}
+
+static void run(uint64_t seed) {
+    static Pair pairs[SLOTS];
+    uint64_t x = seed;
+    for (int i = 0; i < STEPS; i++) {
+        step(pairs[next_random(x) % SLOTS], x);
+        CHECK(smalloc_heap_check());
+    }
+    for (Pair& pair : pairs) {
+        if (pair.m_block) {
+            CHECK(memcmp(pair.m_block, pair.m_copy, pair.m_size) == 0);
+        }
+        sfree(pair.m_block);
+        free(pair.m_copy);
+        pair = Pair();
+    }
+    CHECK(smalloc_heap_check());
+}
+
+int main() {
+    run(0x9E3779B97F4A7C15ull);
+    smalloc_guard_set_rate(8);
+    run(0xD1B54A32D192ED03ull);
+    smalloc_guard_set_rate(0);
+    return 0;
+}
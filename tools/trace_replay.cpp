@@ -0,0 +1,189 @@
+// Replays a trace recorded with smalloc_trace_start() against whichever
+// allocator it is linked with; CMake builds trace_replay_malloc_2..4, or
+//   g++ -O2 -std=c++14 tools/trace_replay.cpp malloc_3.cpp -o replay_malloc_3
+//   ./replay_malloc_3 app.trace
+// Calls are replayed on one thread in timestamp order, so runs are
+// reproducible and comparable between malloc_2, malloc_3 and malloc_4.
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include "../alloc_trace.h"
+#include "../smalloc.h"
+
+#define PAGE_SIZE_BYTES 4096
+
+struct LiveBlock {
+    void* m_ptr;
+    size_t m_size;
+};
+
+static bool load_trace(const char* path, std::vector<TraceRecord>& records) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.m_magic, TRACE_MAGIC, sizeof(header.m_magic)) != 0 ||
+        header.m_record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        fclose(f);
+        return false;
+    }
+    TraceRecord r;
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        records.push_back(r);
+    }
+    fclose(f);
+    // Threads flush whole buffers, so the file is only ordered per thread
+    std::stable_sort(records.begin(), records.end(),
+                     [](const TraceRecord& a, const TraceRecord& b) {
+                         return a.m_timestamp < b.m_timestamp;
+                     });
+    return true;
+}
+
+// Reads a "Key:   123 kB" line from /proc/self/status
+static size_t proc_status_kb(const char* key) {
+    FILE* f = fopen("/proc/self/status", "r");
+    if (!f) {
+        return 0;
+    }
+    char line[256];
+    size_t value = 0;
+    size_t key_len = strlen(key);
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ':') {
+            sscanf(line + key_len + 1, "%zu", &value);
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+// Resets VmHWM so the peak only covers the replay (Linux >= 4.0)
+static void reset_peak_rss() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0) {
+        if (write(fd, "5", 1) != 1) {
+            perror("clear_refs");
+        }
+        close(fd);
+    }
+}
+
+// Writes one byte per page so the RSS reflects what a real user would fault in
+static void touch(void* p, size_t size) {
+    char* c = static_cast<char*>(p);
+    for (size_t off = 0; off < size; off += PAGE_SIZE_BYTES) {
+        c[off] = 1;
+    }
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <trace-file>\n", argv[0]);
+        return 2;
+    }
+    std::vector<TraceRecord> records;
+    if (!load_trace(argv[1], records)) {
+        return 1;
+    }
+
+    std::unordered_map<uint64_t, LiveBlock> live;
+    live.reserve(records.size());
+    size_t live_bytes = 0, peak_live_bytes = 0, heap_bytes_at_peak = 0;
+    size_t failed = 0, unknown_frees = 0;
+
+    size_t baseline_rss_kb = proc_status_kb("VmRSS");
+    reset_peak_rss();
+    uint64_t start = now_ns();
+
+    for (const TraceRecord& r : records) {
+        void* p = nullptr;
+        size_t size = r.m_size;
+        switch (r.m_op) {
+            case TRACE_SMALLOC:
+                p = smalloc(size);
+                break;
+            case TRACE_SCALLOC:
+                size = r.m_aux * r.m_size;
+                p = scalloc(r.m_aux, r.m_size);
+                break;
+            case TRACE_SREALLOC: {
+                void* oldp = nullptr;
+                auto it = r.m_aux ? live.find(r.m_aux) : live.end();
+                if (it != live.end()) {
+                    oldp = it->second.m_ptr;
+                }
+                p = srealloc(oldp, size);
+                if (p && it != live.end()) {
+                    // A failed realloc leaves the old block alive, entry and size unchanged
+                    live_bytes -= it->second.m_size;
+                    live.erase(it);
+                }
+                break;
+            }
+            case TRACE_SFREE: {
+                auto it = live.find(r.m_addr);
+                if (it == live.end()) {
+                    // Allocated before tracing started
+                    unknown_frees++;
+                    continue;
+                }
+                live_bytes -= it->second.m_size;
+                sfree(it->second.m_ptr);
+                live.erase(it);
+                continue;
+            }
+            default:
+                continue;
+        }
+
+        if (!p) {
+            if (r.m_addr) {
+                failed++;
+            }
+            continue;
+        }
+        touch(p, size);
+        if (r.m_addr) {
+            live[r.m_addr] = {p, size};
+        }
+        live_bytes += size;
+        if (live_bytes > peak_live_bytes) {
+            peak_live_bytes = live_bytes;
+            heap_bytes_at_peak = _num_allocated_bytes();
+        }
+    }
+
+    uint64_t elapsed = now_ns() - start;
+    size_t peak_rss_kb = proc_status_kb("VmHWM");
+
+    printf("records: %zu\n", records.size());
+    printf("time_ms: %.3f\n", elapsed / 1e6);
+    printf("ns_per_op: %.1f\n", records.empty() ? 0.0 : (double)elapsed / records.size());
+    printf("baseline_rss_kb: %zu\n", baseline_rss_kb);
+    printf("peak_rss_kb: %zu\n", peak_rss_kb);
+    printf("peak_live_bytes: %zu\n", peak_live_bytes);
+    printf("heap_bytes_at_peak: %zu\n", heap_bytes_at_peak);
+    printf("fragmentation: %.4f\n", heap_bytes_at_peak ?
+           1.0 - (double)peak_live_bytes / heap_bytes_at_peak : 0.0);
+    printf("failed_allocations: %zu\n", failed);
+    printf("unknown_frees: %zu\n", unknown_frees);
+    return 0;
+}